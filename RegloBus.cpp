@@ -0,0 +1,925 @@
+/**
+ * @file RegloBus.cpp
+ *
+ * Interface for controlling several Reglo-CPF pumps sharing one line.
+ */
+
+#include "RegloBus.h"
+
+// Bits on the wire per byte, with start and stop bits.
+const unsigned long BITS_PER_BYTE = 10;
+
+// Quiet time, in bytes on the wire, that ends a failed exchange. Longer
+// than the longest response.
+const unsigned long RESYNC_BYTES = 12;
+
+// Microseconds per step of the pause between a response and the next
+// request to the same pump.
+const unsigned long GAP_UNIT = 100;
+
+// Longest pause, in steps.
+const uint8_t GAP_MAX = 255;
+
+// Paced requests that must succeed before the pause is shortened a step.
+const uint8_t GAP_STREAK = 16;
+
+// Buffer size for a command without parameters, e.g. "8H\r".
+const uint8_t SHORT_REQUEST_SIZE = 4;
+
+/**
+ * Clock time in steps of the pause, wrapping after about 6.5 s.
+ */
+static uint16_t gap_steps(RegloClock* clock) {
+	return clock->micros() / GAP_UNIT;
+}
+
+// The counters are opt-in and budgeted on top of the bus itself.
+#if REGLO_ENABLE_STATS
+REGLO_SIZE_CHECK(RegloBus, REGLO_BUS_SIZE_BUDGET + sizeof(RegloBusStats)
+		+ sizeof(RegloBusMeter*));
+#else
+REGLO_SIZE_CHECK(RegloBus, REGLO_BUS_SIZE_BUDGET);
+#endif
+
+RegloCommand::RegloCommand(RegloCPF* pump, uint8_t command, uint8_t priority,
+		unsigned long deadline) {
+	this->pump = pump;
+	this->command = command;
+	this->priority = priority;
+	this->deadline = deadline;
+	mantisse = 0;
+	exponent = 0;
+	state = REGLO_STATE_IDLE;
+	status = REGLO_OK;
+	callback = NULL;
+	context = NULL;
+	submitted = 0;
+	next = NULL;
+}
+
+bool RegloCommand::done() {
+	return state == REGLO_STATE_IDLE;
+}
+
+RegloBus::RegloBus(Stream* stream, unsigned long baud) {
+	_stream = stream;
+	_aborted = false;
+	_clock = &RegloSystemClock;
+	_queue = NULL;
+	_current = NULL;
+	_byte_time = BITS_PER_BYTE * 1000000UL / baud;
+	_earliest = 0;
+	_quiet_since = 0;
+	_settling = false;
+	_answered = REGLO_MAX_PUMPS;
+	_paced = false;
+	_repeating = false;
+#if REGLO_ENABLE_FLOW_RATE
+	_response_length = 0;
+	_echoed = NULL;
+	_echo_mantisse = 0;
+	_echo_exponent = 0;
+#endif
+#if REGLO_ENABLE_STATS
+	memset(&_stats, 0, sizeof(_stats));
+	_meter = NULL;
+#endif
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		_pumps[i] = NULL;
+	}
+}
+
+int RegloBus::attach(RegloCPF* pump) {
+	if (pump->_address < 1 || pump->_address > REGLO_MAX_PUMPS) {
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	RegloCPF** slot = &_pumps[pump->_address - 1];
+	if (pump->_stream != _stream || (*slot != NULL && *slot != pump)) {
+		return REGLO_ERROR;
+	}
+
+	*slot = pump;
+	pump->_bus = this;
+	pump->_clock = _clock;
+	set_gap(pump->_address, REGLO_COMMAND_GAP);
+	pump->_answered_at = gap_steps(_clock) - GAP_MAX - 1;
+	return REGLO_OK;
+}
+
+RegloCPF* RegloBus::pump(uint8_t address) {
+	if (address < 1 || address > REGLO_MAX_PUMPS) {
+		return NULL;
+	}
+	return _pumps[address - 1];
+}
+
+void RegloBus::set_clock(RegloClock* clock) {
+	_clock = clock;
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		if (_pumps[i] != NULL) {
+			_pumps[i]->_clock = clock;
+		}
+	}
+}
+
+void RegloBus::abort() {
+	_aborted = true;
+}
+
+void RegloBus::resume() {
+	_aborted = false;
+}
+
+bool RegloBus::aborted() {
+	return _aborted;
+}
+
+int RegloBus::emergency_stop(uint8_t* confirmed) {
+	Stop stop;
+	REGLO_STACK_CHECK(sizeof(stop));
+
+	stop_send(&stop);
+	unsigned long started = _clock->millis();
+	while (!stop_collect(&stop)
+			&& _clock->millis() - started < EMERGENCY_STOP_TIMEOUT) {
+		_clock->wait();
+	}
+	return stop_finish(&stop, confirmed);
+}
+
+void RegloBus::stop_send(Stop* stop) {
+	stop->count = 0;
+	stop->requested = 0;
+	stop->mask = 0;
+	stop->replies = 0;
+	stop->positive = 0;
+
+	// Make any exchange in progress give up, and drop what it left behind.
+	_aborted = true;
+	if (_current != NULL) {
+		finish(_current, REGLO_ABORTED);
+	}
+	flush(REGLO_PRIORITY_CRITICAL, REGLO_ABORTED);
+	discard();
+
+	// An abandoned exchange may still be answered among the stops.
+	stop->stale = _settling;
+
+	// Send every stop without waiting for the acknowledgments.
+	uint8_t length = 0;
+	stop->earliest = _clock->micros();
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		if (_pumps[i] != NULL
+				&& _pumps[i]->send(REGLO_COMMAND_STOP, 0, 0, &length) == REGLO_OK) {
+			stop->sent[stop->count++] = i;
+			stop->requested |= 1 << i;
+		}
+	}
+	stop->earliest += length * _byte_time;
+	stop->heard = _clock->micros();
+}
+
+bool RegloBus::stop_collect(Stop* stop) {
+	// Responses carry no address, pumps answer in the order they were asked
+	// and not before the first stop has left the line. A late answer to an
+	// abandoned exchange shows as one reply too many, so wait for the line
+	// to fall quiet after the last one then.
+	for (;;) {
+		if (stop->replies >= stop->count && (!stop->stale
+				|| _clock->micros() - stop->heard
+						>= RESYNC_BYTES * _byte_time)) {
+			return true;
+		}
+		int response = read();
+		if (response == -1) {
+			return false;
+		}
+		stop->heard = _clock->micros();
+		if (response != '*' && response != '#') {
+			continue;
+		}
+		if ((long) (stop->heard - stop->earliest) < 0) {
+			// The answer to the abandoned exchange, before any stop's.
+#if REGLO_ENABLE_STATS
+			_stats.stray++;
+#endif
+			stop->stale = false;
+			continue;
+		}
+		if (response == '*') {
+			stop->positive++;
+			if (stop->replies < stop->count) {
+				stop->mask |= 1 << stop->sent[stop->replies];
+			}
+		}
+		stop->replies++;
+	}
+}
+
+int RegloBus::stop_finish(Stop* stop, uint8_t* confirmed) {
+	// With a reply missing or an extra one the order no longer tells who
+	// answered, unless every reply was a confirmation.
+	uint8_t mask = stop->mask;
+	if (stop->stale) {
+		mask = (stop->replies == stop->count + 1
+				&& stop->positive == stop->replies) ? stop->requested : 0;
+	} else if (stop->replies != stop->count) {
+		mask = 0;
+	}
+
+	// Retry the pumps that did not confirm with an ordinary exchange.
+	_aborted = false;
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		if (_pumps[i] != NULL && !(mask & (1 << i))) {
+			_pumps[i]->clear_buffer();
+			if (_pumps[i]->stop() == REGLO_OK) {
+				mask |= 1 << i;
+			}
+		}
+	}
+
+	if (confirmed != NULL) {
+		*confirmed = mask;
+	}
+
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		if (_pumps[i] != NULL && !(mask & (1 << i))) {
+			return REGLO_ERROR;
+		}
+	}
+	return REGLO_OK;
+}
+
+int RegloBus::synchronize(uint8_t command, uint8_t pumps,
+		RegloSyncReport* report) {
+	char requests[REGLO_MAX_PUMPS][SHORT_REQUEST_SIZE];
+	unsigned long sent[REGLO_MAX_PUMPS];
+	unsigned long acknowledged[REGLO_MAX_PUMPS];
+	uint8_t order[REGLO_MAX_PUMPS];
+	uint8_t count = 0;
+	uint8_t mask = 0;
+	REGLO_STACK_CHECK(sizeof(requests) + sizeof(sent) + sizeof(acknowledged)
+			+ sizeof(order));
+
+	if (command == REGLO_COMMAND_GET_FLOW_RATE
+			|| command == REGLO_COMMAND_SET_FLOW_RATE) {
+		return REGLO_OUT_OF_RANGE;
+	}
+	if (command != REGLO_COMMAND_STOP && _aborted) {
+		return REGLO_ABORTED;
+	}
+
+	// Stage every request before the first one goes out.
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		if (!(pumps & (1 << i))) {
+			continue;
+		}
+		if (_pumps[i] == NULL || _pumps[i]->format(requests[count],
+				SHORT_REQUEST_SIZE, command) != REGLO_OK) {
+			return REGLO_ERROR;
+		}
+		order[count++] = i;
+	}
+
+	quiesce(pumps);
+	discard();
+
+	for (uint8_t k = 0; k < count; k++) {
+		_pumps[order[k]]->transmit(requests[k], command);
+		_stream->flush();
+		sent[k] = _clock->micros();
+	}
+
+	// Responses carry no address, pumps answer in the order they were asked.
+	uint8_t replies = 0;
+	unsigned long started = _clock->millis();
+	while (replies < count
+			&& _clock->millis() - started < REGLO_RESPONSE_TIMEOUT) {
+		int response = read();
+		if (response == -1) {
+			_clock->wait();
+		} else if (response == '*') {
+			mask |= 1 << order[replies];
+		}
+		if (response == '*' || response == '#') {
+			acknowledged[replies++] = _clock->micros();
+		}
+	}
+
+	// Each pump that answered pauses from here. Queued commands learn
+	// their pacing from their own exchanges only.
+	uint16_t now = gap_steps(_clock);
+	_answered = REGLO_MAX_PUMPS;
+	for (uint8_t k = 0; k < replies; k++) {
+		_pumps[order[k]]->_answered_at = now;
+	}
+
+	// With a reply missing the order no longer tells who answered, and the
+	// reply may still come.
+	if (replies != count) {
+		mask = 0;
+		_settling = true;
+		_quiet_since = _clock->micros();
+#if REGLO_ENABLE_STATS
+		_stats.resyncs++;
+#endif
+	}
+
+	if (report != NULL) {
+		memset(report, 0, sizeof(*report));
+		for (uint8_t k = 0; k < count; k++) {
+			report->requested |= 1 << order[k];
+			report->sent[order[k]] = sent[k];
+			if (k < replies && replies == count) {
+				report->acknowledged[order[k]] = acknowledged[k];
+			}
+		}
+		report->confirmed = mask;
+		if (count > 0) {
+			report->send_skew = sent[count - 1] - sent[0];
+		}
+		if (replies > 0) {
+			report->acknowledge_skew = acknowledged[replies - 1] - acknowledged[0];
+		}
+	}
+
+	return (replies == count && mask == pumps) ? REGLO_OK : REGLO_ERROR;
+}
+
+#if REGLO_ENABLE_FLOW_RATE
+int RegloBus::scan(unsigned long timeout, RegloScanReport* report) {
+	char response[RegloCPF::FLOAT_RESPONSE_LENGTH];
+	REGLO_STACK_CHECK(sizeof(response) + sizeof(RegloCPF));
+
+	memset(report, 0, sizeof(*report));
+	if (_aborted) {
+		return REGLO_ABORTED;
+	}
+
+	// The probes come between queued commands, which learn their pacing
+	// from their own exchanges only.
+	quiesce(0);
+	_answered = REGLO_MAX_PUMPS;
+
+	unsigned long started = _clock->millis();
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		if (_clock->millis() - started >= timeout || _aborted) {
+			break;
+		}
+		quiesce(1 << i);
+
+		// Probe through a stand-in, the address may have no pump attached.
+		RegloCPF probe(_stream, i + 1);
+		probe._bus = this;
+		probe._clock = _clock;
+
+		discard();
+		uint8_t length = 0;
+		unsigned long earliest = _clock->micros();
+		if (probe.send(REGLO_COMMAND_GET_FLOW_RATE, 0, 0, &length) != REGLO_OK) {
+			break;
+		}
+		report->probed |= 1 << i;
+		earliest += length * _byte_time;
+
+		// The first byte must come within the probe window, the rest follow
+		// back to back.
+		uint8_t received = 0;
+		unsigned long waiting = _clock->micros();
+		unsigned long window = REGLO_PROBE_TIMEOUT * 1000UL + length * _byte_time;
+		while (received < RegloCPF::FLOAT_RESPONSE_LENGTH
+				&& _clock->micros() - waiting < window) {
+			int input = read();
+			if (input == -1) {
+				_clock->wait();
+				continue;
+			}
+			if ((long) (_clock->micros() - earliest) < 0) {
+#if REGLO_ENABLE_STATS
+				_stats.stray++;
+#endif
+				continue;
+			}
+			response[received++] = input;
+			if (input == '#') {
+				break;
+			}
+			waiting = _clock->micros();
+			window = RESYNC_BYTES * _byte_time;
+		}
+
+		// Any answer shows a pump, even one that is not well formed.
+		if (received > 0) {
+			if (_pumps[i] != NULL) {
+				_pumps[i]->_answered_at = gap_steps(_clock);
+			}
+			report->present |= 1 << i;
+			RegloCPF::parse_float(response, received, &report->mantisse[i],
+					&report->exponent[i]);
+		}
+	}
+
+	report->elapsed = _clock->millis() - started;
+	return (report->probed == (uint8_t) ((1 << REGLO_MAX_PUMPS) - 1)) ? REGLO_OK
+			: REGLO_TIMEOUT;
+}
+#endif
+
+int RegloBus::submit(RegloCommand* command) {
+	if (command->pump == NULL || command->pump->_bus != this) {
+		return REGLO_ERROR;
+	}
+	if (command->state != REGLO_STATE_IDLE) {
+		return REGLO_ERROR;
+	}
+	if (_aborted && command->command != REGLO_COMMAND_STOP) {
+		return REGLO_ABORTED;
+	}
+
+	command->state = REGLO_STATE_QUEUED;
+	command->status = REGLO_OK;
+	command->submitted = _clock->millis();
+
+	// Insert behind every command of the same or higher priority.
+	RegloCommand** link = &_queue;
+	while (*link != NULL && (*link)->priority >= command->priority) {
+		link = &(*link)->next;
+	}
+	command->next = *link;
+	*link = command;
+	return REGLO_OK;
+}
+
+int RegloBus::withdraw(RegloCommand* command) {
+	if (command->state != REGLO_STATE_QUEUED) {
+		return REGLO_ERROR;
+	}
+
+	RegloCommand** link = &_queue;
+	while (*link != NULL && *link != command) {
+		link = &(*link)->next;
+	}
+	if (*link == NULL) {
+		return REGLO_ERROR;
+	}
+	*link = command->next;
+
+#if REGLO_ENABLE_FLOW_RATE
+	if (command == _echoed) {
+		_echoed = NULL;
+	}
+#endif
+	command->next = NULL;
+	command->status = REGLO_ABORTED;
+	command->state = REGLO_STATE_IDLE;
+	return REGLO_OK;
+}
+
+void RegloBus::poll() {
+	if (_current != NULL) {
+		receive();
+	}
+	if (_current == NULL && settled()) {
+		dispatch();
+	}
+}
+
+bool RegloBus::idle() {
+	return _current == NULL && _queue == NULL;
+}
+
+unsigned long RegloBus::gap(uint8_t address) {
+	RegloCPF* pump = this->pump(address);
+	return (pump != NULL) ? pump->_gap * GAP_UNIT : 0;
+}
+
+int RegloBus::set_gap(uint8_t address, unsigned long gap) {
+	RegloCPF* pump = this->pump(address);
+	if (pump == NULL) {
+		return REGLO_ERROR;
+	}
+	unsigned long steps = (gap + GAP_UNIT - 1) / GAP_UNIT;
+	pump->_gap = (steps > GAP_MAX) ? GAP_MAX : steps;
+	pump->_gap_streak = 0;
+	return REGLO_OK;
+}
+
+bool RegloBus::rested(RegloCPF* pump) {
+	// More whole steps than the pause are at least the pause. A pump idle
+	// for about a multiple of the wrap may wait out one pause needlessly.
+	uint16_t elapsed = gap_steps(_clock) - pump->_answered_at;
+	return pump->_gap == 0 || elapsed > pump->_gap;
+}
+
+void RegloBus::quiesce(uint8_t pumps) {
+	for (;;) {
+		if (_current != NULL) {
+			receive();
+		} else if (settled()) {
+			uint8_t i = 0;
+			while (i < REGLO_MAX_PUMPS && (!(pumps & (1 << i))
+					|| _pumps[i] == NULL || rested(_pumps[i]))) {
+				i++;
+			}
+			if (i == REGLO_MAX_PUMPS) {
+				return;
+			}
+		}
+		_clock->wait();
+	}
+}
+
+bool RegloBus::pace(RegloCommand* command, int status) {
+	RegloCPF* pump = command->pump;
+	if (status == REGLO_OK) {
+		if (++pump->_gap_streak >= GAP_STREAK) {
+			pump->_gap_streak = 0;
+			if (pump->_gap > 0) {
+				pump->_gap--;
+			}
+		}
+	} else if (status == REGLO_ERROR || status == REGLO_TIMEOUT) {
+		// Back off quickly, the pump may not have been ready for it. A bad
+		// response is the line or a clamped rate, not the pump's pace.
+		pump->_gap_streak = 0;
+		pump->_gap = (pump->_gap >= GAP_MAX / 2) ? GAP_MAX : pump->_gap * 2 + 1;
+		return true;
+	}
+	return false;
+}
+
+void RegloBus::dispatch() {
+	// In priority order, but a pump that is still pausing holds up only
+	// its own commands and those of lower priority, which must not go
+	// first. Only a command sent again sits ahead of higher priorities, so
+	// the highest held up so far is what counts. A finished command's
+	// callback may submit more, so each finish starts over from the head.
+	RegloCommand** link = &_queue;
+	RegloCommand* held = NULL;
+	while (*link != NULL) {
+		RegloCommand* command = *link;
+		if (held != NULL && command->priority < held->priority) {
+			return;
+		}
+
+		if (command->deadline != 0
+				&& _clock->millis() - command->submitted > command->deadline) {
+			*link = command->next;
+			finish(command, REGLO_EXPIRED);
+			link = &_queue;
+			held = NULL;
+			continue;
+		}
+
+		RegloCPF* pump = command->pump;
+		if (!rested(pump)) {
+			if (held == NULL || command->priority > held->priority) {
+				held = command;
+			}
+			link = &command->next;
+			continue;
+		}
+		*link = command->next;
+
+#if REGLO_ENABLE_FLOW_RATE
+		if (command->command == REGLO_COMMAND_SET_FLOW_RATE
+				&& pump->prepare_flow_rate(&command->mantisse,
+						&command->exponent) != REGLO_OK) {
+			finish(command, REGLO_OUT_OF_RANGE);
+			link = &_queue;
+			held = NULL;
+			continue;
+		}
+#endif
+
+		// Anything left over belongs to an exchange that is already over.
+		discard();
+
+		// Timed before sending, the stream may block until the request is
+		// out, e.g. with a full transmit buffer.
+		uint8_t length = 0;
+		unsigned long sending = _clock->micros();
+		int status = pump->send(command->command, command->mantisse,
+				command->exponent, &length);
+		if (status != REGLO_OK) {
+			finish(command, status);
+			link = &_queue;
+			held = NULL;
+			continue;
+		}
+
+		command->state = REGLO_STATE_SENT;
+		_current = command;
+		_paced = pump->_address - 1 == _answered;
+#if REGLO_ENABLE_STATS
+		_stats.sent++;
+#endif
+		_earliest = sending + length * _byte_time;
+#if REGLO_ENABLE_FLOW_RATE
+		_response_length = 0;
+#endif
+		return;
+	}
+}
+
+void RegloBus::receive() {
+	RegloCommand* command = _current;
+#if REGLO_ENABLE_FLOW_RATE
+	bool rate = command->command == REGLO_COMMAND_GET_FLOW_RATE
+			|| command->command == REGLO_COMMAND_SET_FLOW_RATE;
+#endif
+
+	if (_aborted && command->command != REGLO_COMMAND_STOP) {
+		finish(command, REGLO_ABORTED);
+		return;
+	}
+
+	int input;
+	while ((input = read()) != -1) {
+		// A response cannot start before the request has left the line, so
+		// earlier bytes are left over from a previous exchange. A Stream
+		// does not tell when a byte arrived, so this goes by when it is
+		// read: if poll() runs late, a stray byte still unread once the
+		// request is out is taken as part of the response.
+		if ((long) (_clock->micros() - _earliest) < 0) {
+#if REGLO_ENABLE_STATS
+			_stats.stray++;
+#endif
+			continue;
+		}
+
+		// Give the pump the timeout again for its next byte.
+		_earliest = _clock->micros();
+
+#if REGLO_ENABLE_FLOW_RATE
+		if (_response_length == 0 && input == '#') {
+			finish(command, REGLO_ERROR);
+			return;
+		}
+
+		if (!rate) {
+			finish(command, (input == '*') ? REGLO_OK : REGLO_BAD_RESPONSE);
+			return;
+		}
+
+		_response[_response_length++] = input;
+		if (_response_length == RegloCPF::FLOAT_RESPONSE_LENGTH) {
+			int mantisse = 0;
+			int exponent = 0;
+			int status = RegloCPF::parse_float(_response, _response_length,
+					&mantisse, &exponent);
+			if (status == REGLO_OK) {
+				if (command->command == REGLO_COMMAND_SET_FLOW_RATE) {
+					status = command->pump->confirm_float(command->mantisse,
+							command->exponent, &mantisse, &exponent);
+					if (status != REGLO_OK
+							&& retry_echo(command, mantisse, exponent)) {
+						return;
+					}
+				}
+				command->mantisse = mantisse;
+				command->exponent = exponent;
+			}
+			finish(command, status);
+			return;
+		}
+#else
+		finish(command, (input == '*') ? REGLO_OK
+				: (input == '#') ? REGLO_ERROR : REGLO_BAD_RESPONSE);
+		return;
+#endif
+	}
+
+	if ((long) (_clock->micros() - _earliest)
+			> (long) (REGLO_RESPONSE_TIMEOUT * 1000UL)) {
+		finish(command, REGLO_TIMEOUT);
+	}
+}
+
+#if REGLO_ENABLE_FLOW_RATE
+bool RegloBus::retry_echo(RegloCommand* command, int mantisse, int exponent) {
+	if (_echoed == command) {
+		// The same rate twice is the pump clamping the request.
+		if (mantisse == _echo_mantisse && exponent == _echo_exponent) {
+			command->pump->learn_flow_rate_limit(command->mantisse,
+					command->exponent, mantisse, exponent);
+		}
+		return false;
+	}
+
+	// Only one echo is held. While another pump's command waits out its
+	// pause to be sent again, this one finishes at once, or two clamping
+	// pumps would take the place from each other forever.
+	if (_echoed != NULL) {
+		return false;
+	}
+
+	// Send it again, ahead of everything else, after the pump's pause.
+	_echoed = command;
+	_echo_mantisse = mantisse;
+	_echo_exponent = exponent;
+	_current = NULL;
+	_answered = command->pump->_address - 1;
+	command->pump->_answered_at = gap_steps(_clock);
+	command->state = REGLO_STATE_QUEUED;
+	command->next = _queue;
+	_queue = command;
+	return true;
+}
+#endif
+
+bool RegloBus::discard() {
+	bool dropped = false;
+	while (read() != -1) {
+		dropped = true;
+#if REGLO_ENABLE_STATS
+		_stats.stray++;
+#endif
+	}
+	return dropped;
+}
+
+bool RegloBus::settled() {
+	if (!_settling) {
+		return true;
+	}
+
+	// Late bytes of a failed exchange must not be taken for the next
+	// response, so wait until nothing has arrived for a while.
+	if (discard()) {
+		_quiet_since = _clock->micros();
+	}
+	if (_clock->micros() - _quiet_since < RESYNC_BYTES * _byte_time) {
+		return false;
+	}
+	_settling = false;
+	return true;
+}
+
+#if REGLO_ENABLE_STATS
+const RegloBusStats& RegloBus::stats() {
+	return _stats;
+}
+
+void RegloBus::reset_stats() {
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+void RegloBus::set_meter(RegloBusMeter* meter) {
+	_meter = meter;
+	if (meter != NULL) {
+		memset(meter, 0, sizeof(*meter));
+		meter->started = _clock->micros();
+		meter->line_free = meter->started;
+		meter->pump = REGLO_MAX_PUMPS;
+	}
+}
+
+void RegloBus::read_meter(RegloBusMeter* report) {
+	if (_meter == NULL) {
+		memset(report, 0, sizeof(*report));
+		return;
+	}
+
+	unsigned long now = _clock->micros();
+	*report = *_meter;
+	report->interval = now - _meter->started;
+	if (report->interval >= 1000) {
+		unsigned long share = report->busy / (report->interval / 1000);
+		report->utilization = (share > 1000) ? 1000 : share;
+	}
+
+	// Carry the exchange in progress over into the next interval.
+	unsigned long line_free = _meter->line_free;
+	uint8_t pump = _meter->pump;
+	uint8_t command = _meter->command;
+	bool awaiting = _meter->awaiting;
+	set_meter(_meter);
+	_meter->line_free = line_free;
+	_meter->pump = pump;
+	_meter->command = command;
+	_meter->awaiting = awaiting;
+}
+
+void RegloBus::transmitted(uint8_t address, uint8_t command,
+		uint8_t length, unsigned long now) {
+	if (_meter == NULL) {
+		return;
+	}
+
+	long gap = (long) (now - _meter->line_free);
+	if (gap > 0 && (unsigned long) gap > _meter->idle_max) {
+		_meter->idle_max = gap;
+	}
+
+	unsigned long time = length * _byte_time;
+	_meter->busy += time;
+	_meter->pump = address - 1;
+	_meter->command = command;
+	_meter->pump_time[_meter->pump] += time;
+	_meter->command_time[command] += time;
+
+	// Requests sent back to back queue up behind each other in the UART.
+	if ((long) (_meter->line_free - now) > 0) {
+		now = _meter->line_free;
+	}
+	_meter->line_free = now + time;
+	_meter->awaiting = true;
+}
+#endif
+
+int RegloBus::read() {
+	int input = _stream->read();
+#if REGLO_ENABLE_STATS
+	if (input == -1 || _meter == NULL) {
+		return input;
+	}
+
+	// The byte started arriving one byte time ago.
+	unsigned long now = _clock->micros();
+	unsigned long arrived = now - _byte_time;
+	if (_meter->awaiting && (long) (arrived - _meter->line_free) >= 0) {
+		unsigned long turnaround = arrived - _meter->line_free;
+		_meter->turnarounds++;
+		_meter->turnaround_total += turnaround;
+		if (turnaround > _meter->turnaround_max) {
+			_meter->turnaround_max = turnaround;
+		}
+	}
+	_meter->awaiting = false;
+
+	_meter->busy += _byte_time;
+	if (_meter->pump < REGLO_MAX_PUMPS) {
+		_meter->pump_time[_meter->pump] += _byte_time;
+		_meter->command_time[_meter->command] += _byte_time;
+	}
+	if ((long) (now - _meter->line_free) > 0) {
+		_meter->line_free = now;
+	}
+#endif
+	return input;
+}
+
+void RegloBus::finish(RegloCommand* command, int status) {
+	if (command == _current) {
+		_current = NULL;
+		bool repeat = _paced && pace(command, status) && !_repeating
+				&& !_aborted;
+
+		// Anything but silence is the pump answering.
+		if (status == REGLO_TIMEOUT || status == REGLO_ABORTED) {
+			_answered = REGLO_MAX_PUMPS;
+			command->pump->_answered_at = gap_steps(_clock) - GAP_MAX - 1;
+		} else {
+			_answered = command->pump->_address - 1;
+			command->pump->_answered_at = gap_steps(_clock);
+		}
+
+		if (status == REGLO_TIMEOUT || status == REGLO_BAD_RESPONSE
+				|| status == REGLO_ABORTED) {
+			_settling = true;
+			_quiet_since = _clock->micros();
+#if REGLO_ENABLE_STATS
+			_stats.resyncs++;
+#endif
+		}
+
+		// Try again after the longer pause, ahead of everything else for
+		// the pump.
+		_repeating = repeat;
+		if (repeat) {
+			command->state = REGLO_STATE_QUEUED;
+			command->next = _queue;
+			_queue = command;
+			return;
+		}
+	}
+#if REGLO_ENABLE_FLOW_RATE
+	if (command == _echoed) {
+		_echoed = NULL;
+	}
+#endif
+	command->next = NULL;
+	command->status = status;
+#if REGLO_ENABLE_STATS
+	_stats.finished[status]++;
+#endif
+	command->state = REGLO_STATE_IDLE;
+	if (command->callback != NULL) {
+		command->callback(command);
+	}
+}
+
+void RegloBus::flush(uint8_t priority, int status) {
+	RegloCommand** link = &_queue;
+	while (*link != NULL) {
+		RegloCommand* command = *link;
+		if (command->priority < priority) {
+			*link = command->next;
+			finish(command, status);
+		} else {
+			link = &command->next;
+		}
+	}
+}
@@ -0,0 +1,515 @@
+/**
+ * @file RegloBus.h
+ *
+ * Interface for controlling several Reglo-CPF pumps sharing one line.
+ */
+
+#ifndef REGLO_BUS_H
+#define REGLO_BUS_H
+
+#include "RegloCPF.h"
+
+/**
+ * Number of pump addresses on a line, addresses are 1 to REGLO_MAX_PUMPS.
+ */
+const uint8_t REGLO_MAX_PUMPS = 8;
+
+/**
+ * Priorities of queued commands, higher priorities are sent first.
+ */
+enum {
+	REGLO_PRIORITY_LOW,         //!< Status polling.
+	REGLO_PRIORITY_NORMAL,      //!< Setpoints and configuration.
+	REGLO_PRIORITY_HIGH,        //!< Time critical commands, e.g. stop.
+	REGLO_PRIORITY_CRITICAL     //!< Survives an emergency stop.
+};
+
+/**
+ * Progress of a queued command.
+ */
+enum {
+	REGLO_STATE_IDLE,           //!< Not submitted, or finished.
+	REGLO_STATE_QUEUED,         //!< Waiting to be sent.
+	REGLO_STATE_SENT            //!< Waiting for the response.
+};
+
+/**
+ * A command queued on a RegloBus.
+ *
+ * Commands are owned by the caller and must stay in place until they are
+ * finished, the bus only links them into its queue.
+ */
+struct RegloCommand {
+
+	RegloCPF* pump;             //!< Pump to command.
+	uint8_t command;            //!< One of REGLO_COMMAND_*.
+	uint8_t priority;           //!< One of REGLO_PRIORITY_*.
+	unsigned long deadline;     //!< Milliseconds it may wait, 0 for no limit.
+	int mantisse;               //!< Flow rate sent or received.
+	int exponent;               //!< Flow rate sent or received.
+	uint8_t state;              //!< One of REGLO_STATE_*.
+	int status;                 //!< Result once finished, one of REGLO_*.
+
+	/**
+	 * Called when the command has finished, may be NULL.
+	 */
+	void (*callback)(RegloCommand* command);
+	void* context;              //!< For use by the callback.
+
+	unsigned long submitted;
+	RegloCommand* next;
+
+	RegloCommand(RegloCPF* pump = NULL, uint8_t command = REGLO_COMMAND_STOP,
+			uint8_t priority = REGLO_PRIORITY_NORMAL,
+			unsigned long deadline = 0);
+
+	/**
+	 * Whether the command has finished, see status.
+	 */
+	bool done();
+
+};
+
+#if REGLO_ENABLE_STATS
+/**
+ * Number of distinct REGLO_* return codes.
+ */
+const uint8_t REGLO_STATUS_COUNT = REGLO_EXPIRED + 1;
+
+/**
+ * Number of distinct REGLO_COMMAND_* commands.
+ */
+const uint8_t REGLO_COMMAND_COUNT = REGLO_COMMAND_SET_FLOW_RATE + 1;
+
+/**
+ * Counters kept by a RegloBus.
+ */
+struct RegloBusStats {
+
+	unsigned long sent;         //!< Queued commands sent.
+	unsigned long finished[REGLO_STATUS_COUNT]; //!< Finished, by status.
+	unsigned long stray;        //!< Bytes received outside any exchange.
+	unsigned long resyncs;      //!< Waits for a quiet line after a failure.
+
+};
+
+/**
+ * Line time accounting of a RegloBus, see RegloBus::set_meter().
+ *
+ * Times are microseconds of bytes on the wire at the line speed, so they
+ * add up to the busy time whatever the UART buffers. Responses are
+ * counted against the request they follow.
+ */
+struct RegloBusMeter {
+
+	unsigned long interval;     //!< Time measured, set by read_meter().
+	unsigned long busy;         //!< Time with a byte on the wire.
+	uint16_t utilization;       //!< Busy share of the interval, per mille.
+	unsigned long pump_time[REGLO_MAX_PUMPS];   //!< By address - 1.
+	unsigned long command_time[REGLO_COMMAND_COUNT];    //!< By command.
+	unsigned long turnarounds;  //!< Responses timed.
+	unsigned long turnaround_total; //!< From request sent to response.
+	unsigned long turnaround_max;   //!< Slowest response.
+	unsigned long idle_max;     //!< Longest quiet gap before a request.
+
+	// Kept by the bus.
+	unsigned long started;
+	unsigned long line_free;
+	uint8_t pump;
+	uint8_t command;
+	bool awaiting;
+
+};
+#endif
+
+/**
+ * Timing of a command sent to several pumps at once, see
+ * RegloBus::synchronize().
+ *
+ * Times are micros() readings, indexed by address - 1.
+ */
+struct RegloSyncReport {
+
+	uint8_t requested;          //!< Bit (address - 1) for each pump sent to.
+	uint8_t confirmed;          //!< Bit (address - 1) for each confirmation.
+	unsigned long sent[REGLO_MAX_PUMPS];        //!< Request fully sent.
+	unsigned long acknowledged[REGLO_MAX_PUMPS];    //!< Response received.
+	unsigned long send_skew;    //!< From the first to the last request.
+	unsigned long acknowledge_skew; //!< From the first to the last response.
+
+};
+
+#if REGLO_ENABLE_FLOW_RATE
+/**
+ * Pumps found by RegloBus::scan(), indexed by address - 1.
+ */
+struct RegloScanReport {
+
+	uint8_t probed;             //!< Bit (address - 1) for each address asked.
+	uint8_t present;            //!< Bit (address - 1) for each answer.
+	int mantisse[REGLO_MAX_PUMPS];  //!< Flow rate of each pump present.
+	int exponent[REGLO_MAX_PUMPS];  //!< Flow rate of each pump present.
+	unsigned long elapsed;      //!< Milliseconds the scan took.
+
+};
+#endif
+
+/**
+ * Controller for the pumps attached to one communication stream.
+ */
+class RegloBus {
+
+	friend class RegloCPF;
+	friend class RegloBusGroup;
+	friend class RegloPoller;
+	friend class RegloProgram;
+
+	Stream* _stream;
+	RegloCPF* _pumps[REGLO_MAX_PUMPS];
+	volatile bool _aborted;
+	RegloClock* _clock;
+
+	// Queued commands by descending priority, and the one awaiting a reply.
+	RegloCommand* _queue;
+	RegloCommand* _current;
+	unsigned long _byte_time;
+
+	// When the current request has left the line, or the last byte of its
+	// response was read. Bytes read earlier are stray.
+	unsigned long _earliest;
+	unsigned long _quiet_since;
+	bool _settling;
+
+	// The pump that answered last, whose next request is paced.
+	uint8_t _answered;
+	bool _paced;
+	bool _repeating;
+#if REGLO_ENABLE_FLOW_RATE
+	char _response[RegloCPF::FLOAT_RESPONSE_LENGTH];
+	uint8_t _response_length;
+
+	// A flow rate request sent again after an echo of another rate, and
+	// that echo, to tell a clamp from a corrupted response.
+	RegloCommand* _echoed;
+	int _echo_mantisse;
+	int _echo_exponent;
+#endif
+#if REGLO_ENABLE_STATS
+	RegloBusStats _stats;
+	RegloBusMeter* _meter;
+#endif
+
+	/**
+	 * Read the next byte from the stream, or -1.
+	 */
+	int read();
+
+#if REGLO_ENABLE_STATS
+	/**
+	 * Account a request for the meter.
+	 *
+	 * @param[in] now   Clock time the request was handed to the stream.
+	 */
+	void transmitted(uint8_t address, uint8_t command, uint8_t length,
+			unsigned long now);
+#endif
+
+#if REGLO_ENABLE_FLOW_RATE
+	/**
+	 * Handle the echo of another flow rate than a command requested.
+	 *
+	 * The first such echo sends the command again, unless another command
+	 * is being sent again already. A second one finishes it, and if it
+	 * repeats the first the rate is learned as a limit.
+	 *
+	 * @return Whether the command was sent again.
+	 */
+	bool retry_echo(RegloCommand* command, int mantisse, int exponent);
+#endif
+
+	/**
+	 * Drop received bytes that belong to no exchange.
+	 *
+	 * @return Whether any bytes were dropped.
+	 */
+	bool discard();
+
+	/**
+	 * Whether the line is quiet enough to start the next exchange.
+	 */
+	bool settled();
+
+	/**
+	 * Whether a pump has had its pause since its last response.
+	 */
+	bool rested(RegloCPF* pump);
+
+	/**
+	 * Wait, blocking, for the command in flight to finish, the line to
+	 * settle and some pumps to have their pauses, as poll() would before
+	 * sending to them.
+	 *
+	 * @param[in] pumps     Bit (address - 1) set for each pump to wait
+	 *                      for, whether attached or not.
+	 */
+	void quiesce(uint8_t pumps);
+
+	/**
+	 * Adapt the pause of the pump a command was paced for to its outcome.
+	 *
+	 * @return Whether the pause was lengthened.
+	 */
+	bool pace(RegloCommand* command, int status);
+
+	/**
+	 * Time allowed for all pumps to acknowledge an emergency stop, in ms.
+	 */
+	static const unsigned long EMERGENCY_STOP_TIMEOUT = 250;
+
+	/**
+	 * Progress of an emergency stop, see emergency_stop().
+	 */
+	struct Stop {
+
+		uint8_t sent[REGLO_MAX_PUMPS];  // Pumps stopped, in order.
+		uint8_t count;
+		uint8_t requested;              // Bit (address - 1) for each.
+		uint8_t mask;                   // Bit (address - 1) confirmed.
+		uint8_t replies;
+		uint8_t positive;
+		bool stale;                     // An abandoned answer may follow.
+		unsigned long earliest;         // When a stop can be answered.
+		unsigned long heard;            // When the line last spoke.
+
+	};
+
+	/**
+	 * Abort what is in progress and send every stop back to back.
+	 */
+	void stop_send(Stop* stop);
+
+	/**
+	 * Read the acknowledgments that have arrived, without blocking.
+	 *
+	 * @return Whether all have been heard.
+	 */
+	bool stop_collect(Stop* stop);
+
+	/**
+	 * Stop the pumps that did not confirm one at a time, and accept
+	 * commands again.
+	 */
+	int stop_finish(Stop* stop, uint8_t* confirmed);
+
+	/**
+	 * Send the most urgent queued command that is still wanted, passing
+	 * over those for pumps that are still pausing.
+	 */
+	void dispatch();
+
+	/**
+	 * Consume the response to the command in flight, if it has arrived.
+	 */
+	void receive();
+
+	/**
+	 * Complete a command and hand it back to its owner.
+	 */
+	void finish(RegloCommand* command, int status);
+
+	/**
+	 * Finish every queued command below a priority with a status.
+	 */
+	void flush(uint8_t priority, int status);
+
+public:
+
+	/**
+	 * Construct a new bus controller.
+	 *
+	 * @param[in] stream    Communication stream shared by the pumps.
+	 * @param[in] baud      Line speed, used to tell stale bytes from
+	 *                      responses.
+	 */
+	RegloBus(Stream* stream, unsigned long baud = 9600);
+
+	/**
+	 * Attach a pump to the bus.
+	 *
+	 * The pump must use the same stream as the bus, and no other pump may
+	 * be attached with the same address.
+	 */
+	int attach(RegloCPF* pump);
+
+	/**
+	 * Get the pump attached at an address, or NULL.
+	 */
+	RegloCPF* pump(uint8_t address);
+
+	/**
+	 * Use another time source for the bus and every attached pump.
+	 */
+	void set_clock(RegloClock* clock);
+
+	/**
+	 * Abandon the exchange in progress and refuse further commands.
+	 *
+	 * Safe to call from an interrupt handler, e.g. on a fault input. Blocking
+	 * calls on attached pumps return REGLO_ABORTED, and queued commands
+	 * other than stops are finished with it, until emergency_stop() or
+	 * resume() is called.
+	 */
+	void abort();
+
+	/**
+	 * Accept commands again after abort().
+	 */
+	void resume();
+
+	/**
+	 * Whether the bus has been aborted.
+	 */
+	bool aborted();
+
+	/**
+	 * Stop every attached pump as quickly as possible.
+	 *
+	 * Aborts the exchange in progress and every queued command below
+	 * REGLO_PRIORITY_CRITICAL, sends all stop requests back to back
+	 * and then collects the acknowledgments. Pumps that do not confirm are
+	 * stopped again one at a time. Commands are accepted again afterwards.
+	 *
+	 * @param[out] confirmed    Bit (address - 1) is set for each pump that
+	 *                          confirmed the stop, may be NULL.
+	 * @return REGLO_OK if every pump confirmed, otherwise REGLO_ERROR.
+	 */
+	int emergency_stop(uint8_t* confirmed);
+
+	/**
+	 * Send a command to several pumps with as little skew as possible.
+	 *
+	 * All requests are formatted up front and sent back to back, each one
+	 * timed when its last byte has left the UART, before the responses are
+	 * collected. Waits for the command in flight, if any, to finish, and
+	 * for the line to settle and the pumps to have their pauses first.
+	 *
+	 * @param[in] command   Command without parameters, e.g.
+	 *                      REGLO_COMMAND_START or REGLO_COMMAND_STOP.
+	 * @param[in] pumps     Bit (address - 1) set for each pump to command.
+	 * @param[out] report   Timing of the exchange, may be NULL.
+	 * @return REGLO_OK if every pump confirmed.
+	 */
+	int synchronize(uint8_t command, uint8_t pumps, RegloSyncReport* report);
+
+#if REGLO_ENABLE_FLOW_RATE
+	/**
+	 * Find the pumps on the line, whether attached or not.
+	 *
+	 * Each address is asked for its flow rate in turn. Responses carry no
+	 * address and would collide on the shared line, so the requests cannot
+	 * overlap, but an absent pump costs only REGLO_PROBE_TIMEOUT rather
+	 * than a full response timeout. The protocol has no query for the
+	 * direction of rotation. Waits for the command in flight, if any, to
+	 * finish and for the line to settle first, and for each attached pump
+	 * to have its pause before probing it.
+	 *
+	 * @param[in] timeout   Milliseconds for the whole scan, addresses not
+	 *                      reached by then are left out of report->probed.
+	 * @param[out] report   Pumps found and their flow rates.
+	 * @return REGLO_OK if every address was probed, otherwise REGLO_TIMEOUT.
+	 */
+	int scan(unsigned long timeout, RegloScanReport* report);
+#endif
+
+	/**
+	 * Queue a command.
+	 *
+	 * The command is sent ahead of any queued command of lower priority,
+	 * and finished with REGLO_EXPIRED instead if its deadline passes first.
+	 * Progress is only made by poll().
+	 *
+	 * @return REGLO_OK if queued, REGLO_ABORTED for anything but a stop
+	 *         while the bus is aborted, otherwise REGLO_ERROR.
+	 */
+	int submit(RegloCommand* command);
+
+	/**
+	 * Take a queued command off the queue, without finishing it.
+	 *
+	 * The command is left idle with status REGLO_ABORTED and its callback
+	 * is not called.
+	 *
+	 * @return REGLO_ERROR if the command is not queued, e.g. because it
+	 *         has been sent already.
+	 */
+	int withdraw(RegloCommand* command);
+
+	/**
+	 * Send queued commands and collect responses, without blocking.
+	 *
+	 * Call this frequently, e.g. from loop(). Blocking calls must not be
+	 * made on attached pumps while commands are outstanding.
+	 *
+	 * Bytes are dropped as left over from an earlier exchange by when they
+	 * are read, not when they arrived, so polling less often than a request
+	 * takes to send lets such bytes into the next response.
+	 */
+	void poll();
+
+	/**
+	 * Whether no command is queued or in flight.
+	 */
+	bool idle();
+
+	/**
+	 * Get the pause given to a pump between its response and its next
+	 * queued request, in microseconds.
+	 *
+	 * The pause starts at REGLO_COMMAND_GAP. It is doubled whenever such a
+	 * request fails, and shortened a step at a time while they succeed, so
+	 * it settles just above what the pump needs. A request that fails this
+	 * way is sent once more, after the longer pause, before it is finished.
+	 * While a pump pauses, queued commands for other pumps of the same or
+	 * higher priority go ahead of its own, those of lower priority wait.
+	 */
+	unsigned long gap(uint8_t address);
+
+	/**
+	 * Set the pause given to a pump, see gap().
+	 */
+	int set_gap(uint8_t address, unsigned long gap);
+
+#if REGLO_ENABLE_STATS
+	/**
+	 * Get the counters of the bus.
+	 *
+	 * Stray bytes are responses that arrived after their exchange ended,
+	 * e.g. duplicates or late replies, and a sign of the bus falling out
+	 * of step with the pumps. After a timeout or bad response the bus
+	 * waits for the line to fall quiet before sending again.
+	 */
+	const RegloBusStats& stats();
+
+	/**
+	 * Reset the counters of the bus.
+	 */
+	void reset_stats();
+
+	/**
+	 * Account the line time of every exchange in a meter, NULL to stop.
+	 *
+	 * Covers queued commands as well as blocking calls on attached pumps.
+	 * The meter is reset and must stay in place while it is in use.
+	 */
+	void set_meter(RegloBusMeter* meter);
+
+	/**
+	 * Copy the meter for the interval since it was set or last read, and
+	 * start a new interval.
+	 */
+	void read_meter(RegloBusMeter* report);
+#endif
+
+};
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file RegloBusGroup.cpp
+ *
+ * Several RegloBus lines driven from one loop.
+ */
+
+#include "RegloBusGroup.h"
+
+RegloBusGroup::RegloBusGroup() {
+	_count = 0;
+	for (uint8_t i = 0; i < REGLO_MAX_BUSES; i++) {
+		_buses[i] = NULL;
+	}
+}
+
+int RegloBusGroup::add(RegloBus* bus) {
+	for (uint8_t i = 0; i < _count; i++) {
+		if (_buses[i] == bus) {
+			return REGLO_ERROR;
+		}
+	}
+	if (_count == REGLO_MAX_BUSES) {
+		return REGLO_OUT_OF_RANGE;
+	}
+	_buses[_count++] = bus;
+	return REGLO_OK;
+}
+
+RegloBus* RegloBusGroup::bus(uint8_t index) {
+	return (index < _count) ? _buses[index] : NULL;
+}
+
+void RegloBusGroup::set_clock(RegloClock* clock) {
+	for (uint8_t i = 0; i < _count; i++) {
+		_buses[i]->set_clock(clock);
+	}
+}
+
+int RegloBusGroup::submit(RegloCommand* command) {
+	if (command->pump == NULL) {
+		return REGLO_ERROR;
+	}
+	for (uint8_t i = 0; i < _count; i++) {
+		if (command->pump->_bus == _buses[i]) {
+			return _buses[i]->submit(command);
+		}
+	}
+	return REGLO_ERROR;
+}
+
+void RegloBusGroup::poll() {
+	for (uint8_t i = 0; i < _count; i++) {
+		_buses[i]->poll();
+	}
+}
+
+bool RegloBusGroup::idle() {
+	for (uint8_t i = 0; i < _count; i++) {
+		if (!_buses[i]->idle()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void RegloBusGroup::abort() {
+	for (uint8_t i = 0; i < _count; i++) {
+		_buses[i]->abort();
+	}
+}
+
+int RegloBusGroup::emergency_stop() {
+	RegloBus::Stop stops[REGLO_MAX_BUSES];
+	REGLO_STACK_CHECK(sizeof(stops));
+	if (_count == 0) {
+		return REGLO_OK;
+	}
+
+	abort();
+	for (uint8_t i = 0; i < _count; i++) {
+		_buses[i]->stop_send(&stops[i]);
+	}
+
+	// Collect the acknowledgments of every line at once.
+	RegloClock* clock = _buses[0]->_clock;
+	unsigned long started = clock->millis();
+	for (;;) {
+		bool collected = true;
+		for (uint8_t i = 0; i < _count; i++) {
+			if (!_buses[i]->stop_collect(&stops[i])) {
+				collected = false;
+			}
+		}
+		if (collected || clock->millis() - started
+				>= RegloBus::EMERGENCY_STOP_TIMEOUT) {
+			break;
+		}
+		clock->wait();
+	}
+
+	int status = REGLO_OK;
+	for (uint8_t i = 0; i < _count; i++) {
+		if (_buses[i]->stop_finish(&stops[i], NULL) != REGLO_OK) {
+			status = REGLO_ERROR;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file RegloBusGroup.h
+ *
+ * Several RegloBus lines driven from one loop.
+ */
+
+#ifndef REGLO_BUS_GROUP_H
+#define REGLO_BUS_GROUP_H
+
+#include "RegloBus.h"
+
+/**
+ * Number of lines in a RegloBusGroup, e.g. Serial1 to Serial3 and Serial.
+ */
+const uint8_t REGLO_MAX_BUSES = 4;
+
+/**
+ * Lines on separate serial ports, each with its own queue.
+ *
+ * Every line has an exchange in flight at the same time, so throughput
+ * grows with the number of ports. Commands are queued on the line of their
+ * pump, and poll() advances all lines without blocking.
+ */
+class RegloBusGroup {
+
+	RegloBus* _buses[REGLO_MAX_BUSES];
+	uint8_t _count;
+
+public:
+
+	/**
+	 * Construct an empty group.
+	 */
+	RegloBusGroup();
+
+	/**
+	 * Add a line to the group.
+	 */
+	int add(RegloBus* bus);
+
+	/**
+	 * Get a line by the order it was added in, or NULL.
+	 */
+	RegloBus* bus(uint8_t index);
+
+	/**
+	 * Use another time source for every line and their pumps.
+	 */
+	void set_clock(RegloClock* clock);
+
+	/**
+	 * Queue a command on the line of its pump, see RegloBus::submit().
+	 */
+	int submit(RegloCommand* command);
+
+	/**
+	 * Send queued commands and collect responses on every line, without
+	 * blocking.
+	 */
+	void poll();
+
+	/**
+	 * Whether no command is queued or in flight on any line.
+	 */
+	bool idle();
+
+	/**
+	 * Abort every line, see RegloBus::abort(). Safe to call from an
+	 * interrupt handler.
+	 */
+	void abort();
+
+	/**
+	 * Stop every pump on every line, see RegloBus::emergency_stop().
+	 *
+	 * All lines are aborted before the first stop goes out, so no line
+	 * sends anything else in the meantime. The stops go out on every line
+	 * before any acknowledgment is read, the lines are then read together
+	 * for one timeout, and only the pumps that did not confirm are retried
+	 * line by line.
+	 *
+	 * @return REGLO_OK if every pump confirmed, otherwise REGLO_ERROR.
+	 */
+	int emergency_stop();
+
+};
+
+#endif
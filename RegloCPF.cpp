@@ -6,16 +6,51 @@
  */
 
 #include "RegloCPF.h"
+#include "RegloBus.h"
+
+// On AVR constants are copied to SRAM unless they are kept in flash, so the
+// protocol strings are read from program memory there.
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define REGLO_PROGMEM PROGMEM
+#define REGLO_READ_STRING(p) ((const char*) pgm_read_word(p))
+#define REGLO_READ_CHAR(p) ((char) pgm_read_byte(p))
+#else
+#define REGLO_PROGMEM
+#define REGLO_READ_STRING(p) (*(p))
+#define REGLO_READ_CHAR(p) (*(p))
+#endif
 
 // Command requests.
-const char* REQUEST_START = "%dH\r";
-const char* REQUEST_STOP = "%dI\r";
-const char* REQUEST_DISABLE_CONTROL_PANEL = "%dB\r";
-const char* REQUEST_ENABLE_CONTROL_PANEL = "%dA\r";
-const char* REQUEST_CLOCKWISE = "%dJ\r";
-const char* REQUEST_COUNTER_CLOCKWISE = "%dK\r";
-const char* REQUEST_GET_FLOW_RATE = "%df\r";
-const char* REQUEST_SET_FLOW_RATE = "%df%.4d%c%.1d\r";
+const char REQUEST_START[] REGLO_PROGMEM = "%dH\r";
+const char REQUEST_STOP[] REGLO_PROGMEM = "%dI\r";
+const char REQUEST_CLOCKWISE[] REGLO_PROGMEM = "%dJ\r";
+const char REQUEST_COUNTER_CLOCKWISE[] REGLO_PROGMEM = "%dK\r";
+#if REGLO_ENABLE_CONTROL_PANEL
+const char REQUEST_DISABLE_CONTROL_PANEL[] REGLO_PROGMEM = "%dB\r";
+const char REQUEST_ENABLE_CONTROL_PANEL[] REGLO_PROGMEM = "%dA\r";
+#endif
+#if REGLO_ENABLE_FLOW_RATE
+const char REQUEST_GET_FLOW_RATE[] REGLO_PROGMEM = "%df\r";
+const char REQUEST_SET_FLOW_RATE[] REGLO_PROGMEM = "%df%.4d%c%.1d\r";
+#endif
+
+// Requests for commands without parameters, indexed by REGLO_COMMAND_*.
+const char* const REQUEST_COMMANDS[] REGLO_PROGMEM = {
+	REQUEST_START,
+	REQUEST_STOP,
+	REQUEST_CLOCKWISE,
+	REQUEST_COUNTER_CLOCKWISE,
+#if REGLO_ENABLE_CONTROL_PANEL
+	REQUEST_DISABLE_CONTROL_PANEL,
+	REQUEST_ENABLE_CONTROL_PANEL
+#else
+	NULL,
+	NULL
+#endif
+};
+const uint8_t REQUEST_COMMANDS_COUNT = sizeof(REQUEST_COMMANDS)
+		/ sizeof(REQUEST_COMMANDS[0]);
 
 // Buffer size for command formatting.
 const int BUFFER_SIZE = 16;
@@ -23,146 +58,540 @@ const int BUFFER_SIZE = 16;
 // Command response codes.
 const char RESPONSE_OK = '*';
 const char RESPONSE_ERROR = '#';
-const char RESPONSE_TIMEOUT = -1;
 
-// Common request and confirm pattern as a macro.
-#define REQUEST_AND_CONFIRM(command, ...) { \
-        int __request_code = request(command, ##__VA_ARGS__); \
-        if (__request_code != REGLO_OK) return __request_code; \
-        return confirm(); \
-    }
+REGLO_SIZE_CHECK(RegloCPF, REGLO_PUMP_SIZE_BUDGET);
+
+// Flags for known flow rate limits.
+const uint8_t LIMIT_MIN = 1;
+const uint8_t LIMIT_MAX = 2;
 
 RegloCPF::RegloCPF(Stream* stream, const uint8_t address) {
 	_stream = stream;
 	_address = address;
+	_bus = NULL;
+	_clock = &RegloSystemClock;
+	_result = NULL;
+	_retries = 0;
+	_gap = 0;
+	_gap_streak = 0;
+	_answered_at = 0;
+#if REGLO_ENABLE_FLOW_RATE
+	_min_mantisse = 0;
+	_min_exponent = 0;
+	_max_mantisse = 0;
+	_max_exponent = 0;
+	_limits = 0;
+	_limit_policy = REGLO_LIMIT_REJECT;
+#endif
 }
 
-int RegloCPF::start() {
-	REQUEST_AND_CONFIRM(REQUEST_START, _address);
+int RegloCPF::start(RegloResult* result) {
+	return exchange(REGLO_COMMAND_START, NULL, NULL, result);
 }
 
-int RegloCPF::stop() {
-	REQUEST_AND_CONFIRM(REQUEST_STOP, _address);
+int RegloCPF::stop(RegloResult* result) {
+	return exchange(REGLO_COMMAND_STOP, NULL, NULL, result);
 }
 
-int RegloCPF::disable_control_panel() {
-	REQUEST_AND_CONFIRM(REQUEST_DISABLE_CONTROL_PANEL, _address);
+#if REGLO_ENABLE_CONTROL_PANEL
+int RegloCPF::disable_control_panel(RegloResult* result) {
+	return exchange(REGLO_COMMAND_DISABLE_CONTROL_PANEL, NULL, NULL, result);
 }
 
-int RegloCPF::enable_control_panel() {
-	REQUEST_AND_CONFIRM(REQUEST_ENABLE_CONTROL_PANEL, _address);
+int RegloCPF::enable_control_panel(RegloResult* result) {
+	return exchange(REGLO_COMMAND_ENABLE_CONTROL_PANEL, NULL, NULL, result);
 }
+#endif
 
-int RegloCPF::clockwise() {
-	REQUEST_AND_CONFIRM(REQUEST_CLOCKWISE, _address);
+int RegloCPF::clockwise(RegloResult* result) {
+	return exchange(REGLO_COMMAND_CLOCKWISE, NULL, NULL, result);
 }
 
-int RegloCPF::counterClockwise() {
-	REQUEST_AND_CONFIRM(REQUEST_COUNTER_CLOCKWISE, _address);
+int RegloCPF::counterClockwise(RegloResult* result) {
+	return exchange(REGLO_COMMAND_COUNTER_CLOCKWISE, NULL, NULL, result);
 }
 
-int RegloCPF::get_flow_rate(int* mantisse, int* exponent) {
-	this->clear_buffer();
+#if REGLO_ENABLE_FLOW_RATE
+int RegloCPF::get_flow_rate(int* mantisse, int* exponent,
+		RegloResult* result) {
+	return exchange(REGLO_COMMAND_GET_FLOW_RATE, mantisse, exponent, result);
+}
 
-	int __request_code = request(REQUEST_GET_FLOW_RATE, _address);
-	if (__request_code != REGLO_OK) {
-		return REGLO_INTERNAL_ERROR;
+int RegloCPF::set_flow_rate(int* mantisse, int* exponent,
+		RegloResult* result) {
+	if (prepare_flow_rate(mantisse, exponent) != REGLO_OK) {
+		if (result != NULL) {
+			result->status = REGLO_OUT_OF_RANGE;
+			result->round_trip = 0;
+			result->retries = 0;
+			result->raw_length = 0;
+		}
+		return REGLO_OUT_OF_RANGE;
 	}
+	return exchange(REGLO_COMMAND_SET_FLOW_RATE, mantisse, exponent, result);
+}
 
-	return read_float_from_pump(mantisse, exponent);
+int RegloCPF::prepare_flow_rate(int* mantisse, int* exponent) {
+	// Send the rate in the form the pump echoes it, so the confirmation can
+	// be compared exactly.
+	if (normalize_flow_rate(mantisse, exponent) != REGLO_OK) {
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	// Don't spend a round trip on a rate the pump is known to clamp.
+	return apply_flow_rate_limits(mantisse, exponent);
 }
 
-int RegloCPF::set_flow_rate(int* mantisse, int* exponent) {
-	this->clear_buffer();
+int RegloCPF::read_float_from_pump(int* mantisse, int* exponent) {
+	char input[FLOAT_RESPONSE_LENGTH] = { -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+	REGLO_STACK_CHECK(sizeof(input));
+
+	// The timeout applies to the start of the response and then to each
+	// further byte, not to the response as a whole.
+	int i = 0;
+	while (i < FLOAT_RESPONSE_LENGTH) {
+		int status = await(&input[i], _clock->millis());
+		if (status != REGLO_OK) {
+			return status;
+		}
+		if (*input == '#') {
+			return REGLO_ERROR;
+		}
+		i++;
+	}
 
-	if (*exponent > 9 || *exponent < -9) {
-		return REGLO_OUT_OF_RANGE;
+	return parse_float(input, FLOAT_RESPONSE_LENGTH, mantisse, exponent);
+}
+
+int RegloCPF::parse_float(const char* input, uint8_t length, int* mantisse,
+		int* exponent) {
+	if (length != FLOAT_RESPONSE_LENGTH) {
+		return REGLO_BAD_RESPONSE;
 	}
 
-	if (*mantisse > 9999 || *mantisse < 0) {
-		return REGLO_OUT_OF_RANGE;
+	// Four mantissa digits, "E", the exponent sign and digit, then "\r\n".
+	int value = 0;
+	for (uint8_t i = 0; i < 4; i++) {
+		if (input[i] < '0' || input[i] > '9') {
+			return REGLO_BAD_RESPONSE;
+		}
+		value = value * 10 + (input[i] - '0');
+	}
+	if (input[4] != 'E' || (input[5] != '+' && input[5] != '-')
+			|| input[6] < '0' || input[6] > '9' || input[7] != '\r'
+			|| input[8] != '\n') {
+		return REGLO_BAD_RESPONSE;
 	}
 
-	char exponent_prefix = (*exponent >= 0) ? '+' : '-';
+	*mantisse = value;
+	*exponent = (input[5] == '-') ? -(input[6] - '0') : input[6] - '0';
+	return REGLO_OK;
+}
 
-	/*int buffer=-1;
-	 while (buffer!= -1) {  // leeren von buffer; wichtig weil spter die antwort erwartet wird
-	 buffer = _stream->read();
-	 }*/
+int RegloCPF::read_float_and_confirm(int* mantisse, int* exponent) {
+	int mantisse_echo = 0;
+	int exponent_echo = 0;
+	int error = read_float_from_pump(&mantisse_echo, &exponent_echo);
+	if (error != REGLO_OK) {
+		return error;
+	}
+	error = confirm_float(*mantisse, *exponent, &mantisse_echo, &exponent_echo);
+	*mantisse = mantisse_echo;
+	*exponent = exponent_echo;
+	return error;
+}
 
-	int __request_code = request(REQUEST_SET_FLOW_RATE, _address, *mantisse,
-			exponent_prefix, abs(*exponent));
-	if (__request_code != REGLO_OK) {
-		return REGLO_INTERNAL_ERROR;
+int RegloCPF::confirm_float(int mantisse, int exponent, int* mantisse_echo,
+		int* exponent_echo) {
+	// Compare in canonical form, the request has already been normalized.
+	if (normalize_flow_rate(mantisse_echo, exponent_echo) != REGLO_OK) {
+		*mantisse_echo = mantisse;
+		*exponent_echo = exponent;
+		return REGLO_BAD_RESPONSE;
 	}
-	return read_float_and_confirm(mantisse, exponent);
+
+	// A different echo is the pump clamping the rate to one of its limits,
+	// or a corrupted response, which only asking again can tell apart.
+	//max flow rate value in datasheet was 180ml/min; min flow rate value in datasheet was 0.08ml/min; but depending on the hubvolume of the pump this can change
+	//max flow rate value of our pump was 36 ml/min (manual test),  min flow rate value 0.8 ml/min, respectivily
+	if (compare_flow_rate(mantisse, exponent, *mantisse_echo,
+			*exponent_echo) != 0) {
+		return REGLO_BAD_RESPONSE;
+	}
+	return REGLO_OK;
 }
-int RegloCPF::read_float_from_pump(int* mantisse, int* exponent) {
-	char input[9] = { -1, -1, -1, -1, -1, -1, -1, -1, -1 };
-	while (input[0] == -1) {  // stream not available
-		input[0] = _stream->read();
+
+void RegloCPF::learn_flow_rate_limit(int mantisse, int exponent,
+		int mantisse_echo, int exponent_echo) {
+	// Bring both rates to the smaller exponent. Canonical mantissas have four
+	// digits, so rates further apart than that are distinct anyway.
+	long requested = mantisse;
+	long echoed = mantisse_echo;
+	int shift = exponent - exponent_echo;
+	if (shift > 4 || shift < -4) {
+		shift = (shift > 0) ? 4 : -4;
+	}
+	for (; shift > 0; shift--) {
+		requested *= 10;
+	}
+	for (; shift < 0; shift++) {
+		echoed *= 10;
 	}
 
-	if (*input == '#') {
-		return REGLO_ERROR;
+	// The pump's resolution rounds away less than a percent.
+	long difference = (requested > echoed) ? requested - echoed
+			: echoed - requested;
+	long larger = (requested > echoed) ? requested : echoed;
+	if (difference * 100 <= larger) {
+		return;
 	}
 
-	int i = 1;
-	while (i < 9) {
-		while (input[i] == -1) {   // stream not available
-			input[i] = _stream->read();
+	// Zero is always reachable, and one limit cannot pass the other.
+	if (mantisse_echo == 0) {
+		return;
+	}
+	if (compare_flow_rate(mantisse, exponent, mantisse_echo,
+			exponent_echo) > 0) {
+		if ((_limits & LIMIT_MIN) && compare_flow_rate(mantisse_echo,
+				exponent_echo, _min_mantisse, _min_exponent) < 0) {
+			return;
 		}
-		i++;
+		_max_mantisse = mantisse_echo;
+		_max_exponent = exponent_echo;
+		_limits |= LIMIT_MAX;
+	} else {
+		if ((_limits & LIMIT_MAX) && compare_flow_rate(mantisse_echo,
+				exponent_echo, _max_mantisse, _max_exponent) > 0) {
+			return;
+		}
+		_min_mantisse = mantisse_echo;
+		_min_exponent = exponent_echo;
+		_limits |= LIMIT_MIN;
 	}
+}
 
-	sscanf(input, "%dE%d\r\n", mantisse, exponent);
+int RegloCPF::normalize_flow_rate(int* mantisse, int* exponent) {
+	long value = *mantisse;
+	int power = *exponent;
 
-	return REGLO_OK;
+	if (value < 0) {
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	// Drop digits beyond the resolution of the pump, rounding only on the
+	// last one, since rounding each in turn can carry a digit up that the
+	// exact value does not reach, e.g. 123449E-5 to 1235E-3.
+	while (value != 0 && (value > 99999 || power < -10)) {
+		value /= 10;
+		power++;
+	}
+	if (value > 9999 || (power < -9 && value != 0)) {
+		value = (value + 5) / 10;
+		power++;
+	}
+	if (value > 9999) {
+		// Rounded up to 10000.
+		value /= 10;
+		power++;
+	}
+
+	if (value == 0) {
+		*mantisse = 0;
+		*exponent = 0;
+		return REGLO_OK;
+	}
+
+	// Scale up to four digits, as far as the exponent allows.
+	while (value < 1000 && power > -9) {
+		value *= 10;
+		power--;
+	}
 
+	if (power > 9) {
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	*mantisse = (int) value;
+	*exponent = power;
+	return REGLO_OK;
 }
 
-int RegloCPF::read_float_and_confirm(int* mantisse, int* exponent) {
-	int mantisse_new = 0;
-	int exponent_new = 0;
-	int error = read_float_from_pump(&mantisse_new, &exponent_new);
+int RegloCPF::probe_flow_rate_limits() {
+	int mantisse = 0;
+	int exponent = 0;
+	int error = get_flow_rate(&mantisse, &exponent);
 	if (error != REGLO_OK) {
 		return error;
 	}
 
-	double values = mantisse_new * pow(10, exponent_new);
-	double old = *mantisse * pow(10, *exponent);
-	*mantisse = mantisse_new;
-	*exponent = exponent_new;
+	// Probe without the current limits getting in the way, but keep them
+	// until the probe has found both.
+	uint8_t policy = _limit_policy;
+	uint8_t limits = _limits;
+	int min_mantisse = _min_mantisse;
+	int min_exponent = _min_exponent;
+	int max_mantisse = _max_mantisse;
+	int max_exponent = _max_exponent;
+	_limit_policy = REGLO_LIMIT_CLAMP;
+	forget_flow_rate_limits();
+
+	int probe_mantisse = 9999;
+	int probe_exponent = 9;
+	error = set_flow_rate(&probe_mantisse, &probe_exponent);
+	if (error == REGLO_OK) {
+		// The pump accepted the largest rate as is.
+		_max_mantisse = probe_mantisse;
+		_max_exponent = probe_exponent;
+		_limits |= LIMIT_MAX;
+	} else if (error == REGLO_BAD_RESPONSE && (_limits & LIMIT_MAX)) {
+		error = REGLO_OK;
+	}
 
-	if (round(values * 10000) == round(old * 10000)) { // rounding due to floating point precision and possible inaccuracy of pump response
-		return REGLO_OK;
-	} else {
-		return REGLO_BAD_RESPONSE; //REGLO_BAD_RESPONSE or value too big or too small for the pump
-		//pump will set the highest or lowest possible value and therefore values!= old;
-		//max flow rate value in datasheet was 180ml/min; min flow rate value in datasheet was 0.08ml/min; but depending on the hubvolume of the pump this can change
-		//max flow rate value of our pump was 36 ml/min (manual test),  min flow rate value 0.8 ml/min, respectivily
+	if (error == REGLO_OK) {
+		probe_mantisse = 1;
+		probe_exponent = -9;
+		error = set_flow_rate(&probe_mantisse, &probe_exponent);
+		if (error == REGLO_OK) {
+			_min_mantisse = probe_mantisse;
+			_min_exponent = probe_exponent;
+			_limits |= LIMIT_MIN;
+		} else if (error == REGLO_BAD_RESPONSE && (_limits & LIMIT_MIN)) {
+			error = REGLO_OK;
+		}
+	}
+
+	if (error != REGLO_OK) {
+		_limits = limits;
+		_min_mantisse = min_mantisse;
+		_min_exponent = min_exponent;
+		_max_mantisse = max_mantisse;
+		_max_exponent = max_exponent;
+	}
+
+	// Restore the previous rate, it is within the limits by definition.
+	int restore_error = set_flow_rate(&mantisse, &exponent);
+	_limit_policy = policy;
+	return (error != REGLO_OK) ? error : restore_error;
+}
+
+int RegloCPF::set_flow_rate_limits(int min_mantisse, int min_exponent,
+		int max_mantisse, int max_exponent) {
+	if (normalize_flow_rate(&min_mantisse, &min_exponent) != REGLO_OK
+			|| normalize_flow_rate(&max_mantisse, &max_exponent) != REGLO_OK) {
+		return REGLO_OUT_OF_RANGE;
+	}
+	if (compare_flow_rate(min_mantisse, min_exponent, max_mantisse,
+			max_exponent) > 0) {
+		return REGLO_OUT_OF_RANGE;
 	}
+
+	_min_mantisse = min_mantisse;
+	_min_exponent = min_exponent;
+	_max_mantisse = max_mantisse;
+	_max_exponent = max_exponent;
+	_limits = LIMIT_MIN | LIMIT_MAX;
+	return REGLO_OK;
 }
 
-int RegloCPF::request(const char* command, ...) {
+int RegloCPF::get_flow_rate_limits(int* min_mantisse, int* min_exponent,
+		int* max_mantisse, int* max_exponent) {
+	if (_limits != (LIMIT_MIN | LIMIT_MAX)) {
+		return REGLO_ERROR;
+	}
+
+	*min_mantisse = _min_mantisse;
+	*min_exponent = _min_exponent;
+	*max_mantisse = _max_mantisse;
+	*max_exponent = _max_exponent;
+	return REGLO_OK;
+}
+
+void RegloCPF::forget_flow_rate_limits() {
+	_limits = 0;
+}
+
+void RegloCPF::set_limit_policy(uint8_t policy) {
+	_limit_policy = policy;
+}
+
+uint8_t RegloCPF::limit_policy() {
+	return _limit_policy;
+}
+
+int RegloCPF::apply_flow_rate_limits(int* mantisse, int* exponent) {
+	if ((_limits & LIMIT_MIN) && compare_flow_rate(*mantisse, *exponent,
+			_min_mantisse, _min_exponent) < 0) {
+		if (_limit_policy != REGLO_LIMIT_CLAMP) {
+			return REGLO_OUT_OF_RANGE;
+		}
+		*mantisse = _min_mantisse;
+		*exponent = _min_exponent;
+	}
+
+	if ((_limits & LIMIT_MAX) && compare_flow_rate(*mantisse, *exponent,
+			_max_mantisse, _max_exponent) > 0) {
+		if (_limit_policy != REGLO_LIMIT_CLAMP) {
+			return REGLO_OUT_OF_RANGE;
+		}
+		*mantisse = _max_mantisse;
+		*exponent = _max_exponent;
+	}
+
+	return REGLO_OK;
+}
+
+int RegloCPF::compare_flow_rate(int mantisse_a, int exponent_a,
+		int mantisse_b, int exponent_b) {
+	// Canonical mantissas have four digits, so exponents decide first; only
+	// zero and rates at the smallest exponent have fewer.
+	if (mantisse_a == 0 || mantisse_b == 0) {
+		return (mantisse_a > mantisse_b) - (mantisse_a < mantisse_b);
+	}
+	if (exponent_a != exponent_b) {
+		return (exponent_a > exponent_b) ? 1 : -1;
+	}
+	return (mantisse_a > mantisse_b) - (mantisse_a < mantisse_b);
+}
+#endif
+
+int RegloCPF::request(char* buffer, uint8_t size, const char* command, ...) {
 	va_list args;
-	char buffer[BUFFER_SIZE];
+	uint8_t length = 0;
+	bool valid = true;
+	char c;
 
-// Format the command from the variadic argument list.
+// Format the command from the variadic argument list. Only the conversions
+// used by the request templates are supported: %c, %d and %.<digits>d.
 	va_start(args, command);
-	int result = vsnprintf(buffer, BUFFER_SIZE, command, args);
+	while (valid && (c = REGLO_READ_CHAR(command++)) != '\0') {
+		if (c != '%') {
+			buffer[length++] = c;
+		} else {
+			uint8_t precision = 1;
+			c = REGLO_READ_CHAR(command++);
+			if (c == '.') {
+				precision = REGLO_READ_CHAR(command++) - '0';
+				c = REGLO_READ_CHAR(command++);
+			}
+
+			if (c == 'c') {
+				buffer[length++] = (char) va_arg(args, int);
+			} else if (c == 'd') {
+				int value = va_arg(args, int);
+				unsigned int magnitude = (value < 0) ? -(unsigned int) value : value;
+				// Under three digits per byte, for an int of any width.
+				char digits[sizeof(int) * 3];
+				uint8_t count = 0;
+				do {
+					digits[count++] = '0' + magnitude % 10;
+					magnitude /= 10;
+				} while (magnitude != 0);
+
+				if (value < 0 && length < size) {
+					buffer[length++] = '-';
+				}
+				while (precision > count && length < size) {
+					buffer[length++] = '0';
+					precision--;
+				}
+				while (count > 0 && length < size) {
+					buffer[length++] = digits[--count];
+				}
+			} else {
+				valid = false;
+			}
+		}
+
+		if (length >= size) {
+			valid = false;
+		}
+	}
 	va_end(args);
 
 // If the command was malformed or could not fit in the buffer, fail fast.
-	if (result == -1 || result >= BUFFER_SIZE) {
+	if (!valid) {
 		return REGLO_INTERNAL_ERROR;
 	}
+	buffer[length] = '\0';
+	return REGLO_OK;
+}
+
+void RegloCPF::transmit(const char* request, uint8_t command) {
+#if REGLO_ENABLE_STATS
+	unsigned long started = _clock->micros();
+#endif
+	_stream->print(request);
+#if REGLO_ENABLE_STATS
+	if (_bus != NULL) {
+		_bus->transmitted(_address, command, strlen(request), started);
+	}
+#else
+	(void) command;
+#endif
+}
+
+int RegloCPF::receive() {
+#if REGLO_ENABLE_STATS
+	if (_bus != NULL) {
+		return _bus->read();
+	}
+#endif
+	return _stream->read();
+}
+
+int RegloCPF::send(uint8_t command, int mantisse, int exponent,
+		uint8_t* length) {
+	char buffer[BUFFER_SIZE];
+	REGLO_STACK_CHECK(sizeof(buffer));
+
+	// Nothing but a stop goes out while the bus is aborted.
+	if (command != REGLO_COMMAND_STOP && aborted()) {
+		return REGLO_ABORTED;
+	}
+
+	int result = format(buffer, BUFFER_SIZE, command, mantisse, exponent);
+	if (result != REGLO_OK) {
+		return result;
+	}
 
-// Send the command to the pump.
-	_stream->print(buffer);
+	transmit(buffer, command);
+	if (length != NULL) {
+		*length = strlen(buffer);
+	}
 	return REGLO_OK;
 }
 
+int RegloCPF::format(char* buffer, uint8_t size, uint8_t command,
+		int mantisse, int exponent) {
+#if !REGLO_ENABLE_FLOW_RATE
+	(void) mantisse;
+	(void) exponent;
+#endif
+
+	switch (command) {
+#if REGLO_ENABLE_FLOW_RATE
+	case REGLO_COMMAND_GET_FLOW_RATE:
+		return request(buffer, size, REQUEST_GET_FLOW_RATE, _address);
+	case REGLO_COMMAND_SET_FLOW_RATE:
+		return request(buffer, size, REQUEST_SET_FLOW_RATE, _address, mantisse,
+				(exponent >= 0) ? '+' : '-', abs(exponent));
+#endif
+	default:
+		if (command >= REQUEST_COMMANDS_COUNT) {
+			return REGLO_INTERNAL_ERROR;
+		}
+		const char* request_command = REGLO_READ_STRING(&REQUEST_COMMANDS[command]);
+		if (request_command == NULL) {
+			return REGLO_INTERNAL_ERROR;
+		}
+		return request(buffer, size, request_command, _address);
+	}
+}
+
+bool RegloCPF::aborted() {
+	return _bus != NULL && _bus->aborted();
+}
+
 char RegloCPF::read() {
 	if (_stream->available()) {
 		return _stream->read();
@@ -170,29 +599,167 @@ char RegloCPF::read() {
 	return -1;
 }
 
+int RegloCPF::exchange(uint8_t command, int* mantisse, int* exponent,
+		RegloResult* result) {
+	unsigned long started = _clock->micros();
+	_result = result;
+
+#if REGLO_ENABLE_FLOW_RATE
+	// The prepared rate, and the last echo of another rate, to tell a
+	// corrupted echo from a clamped one.
+	int requested_mantisse = (mantisse != NULL) ? *mantisse : 0;
+	int requested_exponent = (exponent != NULL) ? *exponent : 0;
+	int echo_mantisse = 0;
+	int echo_exponent = 0;
+	bool echoed = false;
+#endif
+
+	uint8_t retries = 0;
+	int status;
+	for (;;) {
+		if (result != NULL) {
+			result->raw_length = 0;
+		}
+		status = attempt(command, mantisse, exponent, retries > 0);
+#if REGLO_ENABLE_FLOW_RATE
+		// A well formed echo of another rate is the pump clamping the
+		// request, or the line corrupting the echo. The request is sent
+		// again, even without retries left, and only the same rate echoed
+		// twice in a row is taken as a clamp.
+		if (command == REGLO_COMMAND_SET_FLOW_RATE && status == REGLO_BAD_RESPONSE
+				&& (*mantisse != requested_mantisse
+						|| *exponent != requested_exponent)) {
+			if (echoed && *mantisse == echo_mantisse
+					&& *exponent == echo_exponent) {
+				learn_flow_rate_limit(requested_mantisse, requested_exponent,
+						*mantisse, *exponent);
+				break;
+			}
+			echo_mantisse = *mantisse;
+			echo_exponent = *exponent;
+			if (!echoed) {
+				echoed = true;
+				*mantisse = requested_mantisse;
+				*exponent = requested_exponent;
+				retries++;
+				continue;
+			}
+		} else {
+			echoed = false;  // Anything else between breaks the pair.
+		}
+#endif
+		if (retries >= _retries
+				|| (status != REGLO_TIMEOUT && status != REGLO_BAD_RESPONSE)) {
+			break;
+		}
+#if REGLO_ENABLE_FLOW_RATE
+		if (command == REGLO_COMMAND_SET_FLOW_RATE) {
+			*mantisse = requested_mantisse;
+			*exponent = requested_exponent;
+		}
+#endif
+		retries++;
+	}
+
+	_result = NULL;
+
+	if (result != NULL) {
+		result->status = status;
+		result->round_trip = _clock->micros() - started;
+		result->retries = retries;
+	}
+	return status;
+}
+
+int RegloCPF::attempt(uint8_t command, int* mantisse, int* exponent,
+		bool retry) {
+#if REGLO_ENABLE_FLOW_RATE
+	bool rate = command == REGLO_COMMAND_GET_FLOW_RATE
+			|| command == REGLO_COMMAND_SET_FLOW_RATE;
+#else
+	bool rate = false;
+#endif
+
+	// Drop what is left of an earlier response before waiting for this one.
+	if (rate || retry) {
+		this->clear_buffer();
+	}
+
+	int status;
+#if REGLO_ENABLE_FLOW_RATE
+	if (command == REGLO_COMMAND_SET_FLOW_RATE) {
+		status = send(command, *mantisse, *exponent);
+	} else
+#endif
+	{
+		status = send(command);
+	}
+	if (status != REGLO_OK) {
+		return status;
+	}
+
+#if REGLO_ENABLE_FLOW_RATE
+	if (command == REGLO_COMMAND_GET_FLOW_RATE) {
+		return read_float_from_pump(mantisse, exponent);
+	}
+	if (command == REGLO_COMMAND_SET_FLOW_RATE) {
+		return read_float_and_confirm(mantisse, exponent);
+	}
+#endif
+	(void) mantisse;
+	(void) exponent;
+	return confirm();
+}
+
+void RegloCPF::set_retries(uint8_t retries) {
+	_retries = retries;
+}
+
 void RegloCPF::clear_buffer() {
-	while (_stream->read() != -1) {
-		_stream->read();
+	while (receive() != -1) {
+		receive();
 	}
 }
 
-int RegloCPF::confirm() {
-	char response = _stream->read();
-	int time=0;
+void RegloCPF::set_clock(RegloClock* clock) {
+	_clock = clock;
+}
 
-	while (response == -1 && time<10000) {  // stream not available
-		time++;
-		response = _stream->read();
+int RegloCPF::await(char* input, unsigned long started) {
+	// Read into an int, a 0xFF byte would otherwise pass for -1.
+	int received = receive();
+	while (received == -1) {  // stream not available
+		if (aborted()) {
+			// The response may still come, the bus must let it pass.
+			_bus->_settling = true;
+			_bus->_quiet_since = _clock->micros();
+			return REGLO_ABORTED;
+		}
+		if (_clock->millis() - started >= REGLO_RESPONSE_TIMEOUT) {
+			return REGLO_TIMEOUT;
+		}
+		_clock->wait();
+		received = receive();
 	}
+	*input = received;
+	if (_result != NULL && _result->raw_length < REGLO_RAW_RESPONSE_SIZE) {
+		_result->raw[_result->raw_length++] = *input;
+	}
+	return REGLO_OK;
+}
 
+int RegloCPF::confirm() {
+	char response;
+	int status = await(&response, _clock->millis());
+	if (status != REGLO_OK) {
+		return status;
+	}
 
 	switch (response) {
 	case RESPONSE_OK:
 		return REGLO_OK;
 	case RESPONSE_ERROR:
 		return REGLO_ERROR;
-	case RESPONSE_TIMEOUT:
-           	return REGLO_TIMEOUT;
 	default:
 		return REGLO_BAD_RESPONSE;
 	}
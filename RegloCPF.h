@@ -15,6 +15,9 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include "RegloConfig.h"
+#include "RegloClock.h"
+
 /**
  * Return codes for pump control commands.
  */
@@ -24,34 +27,194 @@ enum {
 	REGLO_TIMEOUT,          //!< Response not received in time.
 	REGLO_OUT_OF_RANGE,     //!< Parameter is not within safe range.
 	REGLO_INTERNAL_ERROR,   //!< Internal error in the control interface.
-	REGLO_BAD_RESPONSE      //!< Unknown response from pump.
+	REGLO_BAD_RESPONSE,     //!< Unknown response from pump.
+	REGLO_ABORTED,          //!< Command abandoned for an emergency stop.
+	REGLO_EXPIRED           //!< Command not sent before its deadline.
+};
+
+/**
+ * Pump commands, for issuing through a RegloBus.
+ */
+enum {
+	REGLO_COMMAND_START,
+	REGLO_COMMAND_STOP,
+	REGLO_COMMAND_CLOCKWISE,
+	REGLO_COMMAND_COUNTER_CLOCKWISE,
+	REGLO_COMMAND_DISABLE_CONTROL_PANEL,
+	REGLO_COMMAND_ENABLE_CONTROL_PANEL,
+	REGLO_COMMAND_GET_FLOW_RATE,
+	REGLO_COMMAND_SET_FLOW_RATE
+};
+
+/**
+ * Handling of flow rates outside the known limits of a pump.
+ */
+enum {
+	REGLO_LIMIT_REJECT,     //!< Fail with REGLO_OUT_OF_RANGE before sending.
+	REGLO_LIMIT_CLAMP       //!< Send the nearest limit instead.
+};
+
+/**
+ * Longest response of a pump, a flow rate such as "3600E-2\r\n".
+ */
+const uint8_t REGLO_RAW_RESPONSE_SIZE = 9;
+
+/**
+ * Outcome of a pump command, for callers that monitor their calls.
+ */
+struct RegloResult {
+	int status;                 //!< REGLO_* code, as returned by the call.
+	unsigned long round_trip;   //!< Microseconds from the first request to the outcome.
+	uint8_t retries;            //!< Requests repeated after a timeout or bad response.
+	uint8_t raw_length;         //!< Number of bytes in raw.
+	char raw[REGLO_RAW_RESPONSE_SIZE]; //!< Response of the last request, as received.
 };
 
+class RegloBus;
+
 /**
  * Reglo-CPF pump control interface.
  */
 class RegloCPF {
 
+	friend class RegloBus;
+	friend class RegloBusGroup;
+	friend class RegloAwaitable;
+
 	Stream* _stream;
 	uint8_t _address;
+	RegloBus* _bus;
+	RegloClock* _clock;
+	RegloResult* _result;
+	uint8_t _retries;
+
+	// Pause before a request that follows this pump's own response, and
+	// the run of such requests that went well, see RegloBus.
+	uint8_t _gap;
+	uint8_t _gap_streak;
+	uint16_t _answered_at;
+
+#if REGLO_ENABLE_FLOW_RATE
+	// Flow rate limits of this pump in canonical form, see _limits.
+	int _min_mantisse;
+	int _min_exponent;
+	int _max_mantisse;
+	int _max_exponent;
+	uint8_t _limits;
+	uint8_t _limit_policy;
+#endif
 
 	/**
-	 * Issue a request to the digital pump.
+	 * Format a request to the digital pump.
 	 *
-	 * @param[in] command   Command string.
+	 * @param[out] buffer   Formatted request.
+	 * @param[in] size      Size of the buffer.
+	 * @param[in] command   Command string, in program memory on AVR.
 	 * @param[in] ...       Command parameters.
 	 */
-	int request(const char* command, ...);
+	int request(char* buffer, uint8_t size, const char* command, ...);
+
+	/**
+	 * Format a command for this pump, see send().
+	 */
+	int format(char* buffer, uint8_t size, uint8_t command, int mantisse = 0,
+			int exponent = 0);
+
+	/**
+	 * Write a formatted request to the stream.
+	 */
+	void transmit(const char* request, uint8_t command);
+
+	/**
+	 * Read the next byte from the stream, or -1.
+	 */
+	int receive();
+
+	/**
+	 * Issue a command, the flow rate is only used by
+	 * REGLO_COMMAND_SET_FLOW_RATE and must have been prepared.
+	 *
+	 * @param[out] length   Number of bytes sent, may be NULL.
+	 */
+	int send(uint8_t command, int mantisse = 0, int exponent = 0,
+			uint8_t* length = NULL);
+
+	/**
+	 * Issue a command and wait for its response, repeating the request
+	 * after a timeout or bad response as configured by set_retries().
+	 *
+	 * @param[in,out] mantisse  Flow rate of rate commands, otherwise NULL.
+	 * @param[in,out] exponent  Flow rate of rate commands, otherwise NULL.
+	 * @param[out] result       Outcome of the command, may be NULL.
+	 */
+	int exchange(uint8_t command, int* mantisse, int* exponent,
+			RegloResult* result);
+
+	/**
+	 * Issue a command once and wait for its response, see exchange().
+	 */
+	int attempt(uint8_t command, int* mantisse, int* exponent, bool retry);
+
+	/**
+	 * Wait for the next byte of a response, which is recorded in the
+	 * result of the current exchange.
+	 *
+	 * @param[out] input    Byte received.
+	 * @param[in] started   Clock time the wait for the response started.
+	 */
+	int await(char* input, unsigned long started);
 
 	/**
 	 * Return the response to a command that succeeds or fails.
 	 */
 	int confirm();
 
+	/**
+	 * Whether the bus this pump is attached to has been aborted.
+	 */
+	bool aborted();
 
+#if REGLO_ENABLE_FLOW_RATE
 	int read_float_from_pump( int* mantisse, int* exponent);
 	int read_float_and_confirm(int* mantisse, int* exponent);
 
+	/**
+	 * Check the flow rate echoed by the pump against the one requested.
+	 *
+	 * @param[in] mantisse          Canonical rate requested.
+	 * @param[in] exponent          Canonical rate requested.
+	 * @param[in,out] mantisse_echo Rate echoed, left in canonical form.
+	 * @param[in,out] exponent_echo Rate echoed, left in canonical form.
+	 * @return REGLO_BAD_RESPONSE if the rates differ.
+	 */
+	int confirm_float(int mantisse, int exponent, int* mantisse_echo,
+			int* exponent_echo);
+
+	/**
+	 * Record a repeated echo of another rate than requested as the limit
+	 * the pump clamped the request to. An echo within the rounding of the
+	 * pump's resolution is no limit and is ignored.
+	 */
+	void learn_flow_rate_limit(int mantisse, int exponent, int mantisse_echo,
+			int exponent_echo);
+
+	/**
+	 * Normalize a flow rate and apply the known limits before sending it.
+	 */
+	int prepare_flow_rate(int* mantisse, int* exponent);
+
+	/**
+	 * Apply the known flow rate limits to a canonical flow rate.
+	 */
+	int apply_flow_rate_limits(int* mantisse, int* exponent);
+
+	/**
+	 * Order two canonical flow rates, returning -1, 0 or 1.
+	 */
+	static int compare_flow_rate(int mantisse_a, int exponent_a,
+			int mantisse_b, int exponent_b);
+#endif
+
 public:
 
 	/**
@@ -62,51 +225,156 @@ public:
 	 */
 	RegloCPF(Stream* stream, const uint8_t address);
 
+	/*
+	 * Each command optionally fills a RegloResult with its status, round
+	 * trip time, retries and the raw response, e.g. to see what the pump
+	 * sent on REGLO_BAD_RESPONSE.
+	 */
+
 	/**
 	 * Start the pump.
 	 */
-	int start();
+	int start(RegloResult* result = NULL);
 
 	/**
 	 * Stop the pump.
 	 */
-	int stop();
+	int stop(RegloResult* result = NULL);
 
 	/**
 	 * Set revolution in clockwise direction.
 	 */
-	int clockwise();
+	int clockwise(RegloResult* result = NULL);
 
 	/**
 	 * Set revolution in counter-clockwise direction.
 	 */
-	int counterClockwise();
-
+	int counterClockwise(RegloResult* result = NULL);
 
+#if REGLO_ENABLE_CONTROL_PANEL
 	/**
 	 * Set control panel inactive.
 	 */
-	int disable_control_panel();
+	int disable_control_panel(RegloResult* result = NULL);
 
 	/**
 	 * Switch control panel to manual operation.
 	 */
-	int enable_control_panel();
+	int enable_control_panel(RegloResult* result = NULL);
+#endif
 
+#if REGLO_ENABLE_FLOW_RATE
 	/**
 	 * Flow rate in ml per minute
 	 */
-	int get_flow_rate(int* mantisse, int* exponent);
+	int get_flow_rate(int* mantisse, int* exponent,
+			RegloResult* result = NULL);
 
 	/**
 	 * Set flow rate in ml per minute; first value is Mantisse; second value is Exponent e.g. -2 or 7
+	 *
+	 * The requested rate is normalized before it is sent and on success the
+	 * parameters hold the rate echoed by the pump, in canonical form. On
+	 * REGLO_BAD_RESPONSE they hold the other rate the pump echoed last. A
+	 * request echoed with another rate is sent once more, and only when the
+	 * same rate comes back twice in a row is it learned as a limit.
 	 */
-	int set_flow_rate(int* mantisse, int* exponent);
+	int set_flow_rate(int* mantisse, int* exponent,
+			RegloResult* result = NULL);
 
+	/**
+	 * Convert a flow rate to the canonical form echoed by the pump.
+	 *
+	 * The pump reports rates with a four digit mantissa (1000 to 9999) and a
+	 * single digit exponent, so any other representation of the same rate is
+	 * scaled, and rounded to four significant digits, to match. Zero is
+	 * represented as 0E0.
+	 *
+	 * @param[in,out] mantisse  Mantissa, must not be negative.
+	 * @param[in,out] exponent  Exponent.
+	 */
+	static int normalize_flow_rate(int* mantisse, int* exponent);
+
+	/**
+	 * Length of a flow rate response, e.g. "3600E-2\r\n".
+	 */
+	static const uint8_t FLOAT_RESPONSE_LENGTH = REGLO_RAW_RESPONSE_SIZE;
+
+	/**
+	 * Parse a flow rate response, e.g. "3600E-2\r\n".
+	 *
+	 * Any input other than a complete, well formed response is rejected
+	 * with REGLO_BAD_RESPONSE and leaves the outputs untouched. Only the
+	 * given length is read, no terminator is needed.
+	 *
+	 * @param[in] input     Response bytes.
+	 * @param[in] length    Number of response bytes, only
+	 *                      FLOAT_RESPONSE_LENGTH can be well formed.
+	 * @param[out] mantisse Mantissa of the flow rate.
+	 * @param[out] exponent Exponent of the flow rate.
+	 */
+	static int parse_float(const char* input, uint8_t length, int* mantisse,
+			int* exponent);
+
+	/**
+	 * Measure the flow rate limits of the pump.
+	 *
+	 * Requests the largest and smallest representable rates, records the
+	 * values the pump clamps them to and restores the previous rate. The
+	 * pump should be stopped while probing. Unless both limits are
+	 * confirmed the limits known before are kept and the failure returned.
+	 */
+	int probe_flow_rate_limits();
+
+	/**
+	 * Set the flow rate limits of the pump, e.g. from a datasheet.
+	 */
+	int set_flow_rate_limits(int min_mantisse, int min_exponent,
+			int max_mantisse, int max_exponent);
+
+	/**
+	 * Get the flow rate limits of the pump, in canonical form.
+	 *
+	 * Limits are also learned whenever the pump clamps a requested rate and
+	 * the same rate is echoed to a second request, so this fails with
+	 * REGLO_ERROR only until both have been seen.
+	 */
+	int get_flow_rate_limits(int* min_mantisse, int* min_exponent,
+			int* max_mantisse, int* max_exponent);
+
+	/**
+	 * Discard the known flow rate limits.
+	 */
+	void forget_flow_rate_limits();
+
+	/**
+	 * Choose how set_flow_rate() handles rates outside the known limits.
+	 *
+	 * @param[in] policy    REGLO_LIMIT_REJECT (default) or REGLO_LIMIT_CLAMP.
+	 */
+	void set_limit_policy(uint8_t policy);
+
+	/**
+	 * Get how set_flow_rate() handles rates outside the known limits.
+	 */
+	uint8_t limit_policy();
+#endif
 
 
 	void clear_buffer();
 
+	/**
+	 * Repeat a request up to this many times after a timeout or a bad
+	 * response, none by default. All commands are idempotent, so a repeat
+	 * is safe even if the pump acted on the lost request.
+	 */
+	void set_retries(uint8_t retries);
+
+	/**
+	 * Use another time source, e.g. a RegloVirtualClock.
+	 */
+	void set_clock(RegloClock* clock);
+
 	/**
 		 * For debugging purposes.
 		 */
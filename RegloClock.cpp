@@ -0,0 +1,67 @@
+/**
+ * @file RegloClock.cpp
+ *
+ * Time source for pump communication.
+ */
+
+#include <Arduino.h>
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#endif
+#include "RegloClock.h"
+
+RegloClock RegloSystemClock;
+
+unsigned long RegloClock::millis() {
+	return ::millis();
+}
+
+unsigned long RegloClock::micros() {
+	return ::micros();
+}
+
+void RegloClock::wait() {
+}
+
+void RegloSleepClock::wait() {
+#if defined(__AVR__)
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sleep_cpu();
+	sleep_disable();
+#elif defined(__arm__)
+	__asm__ volatile ("wfi");
+#else
+	yield();
+#endif
+}
+
+RegloVirtualClock::RegloVirtualClock(unsigned long step) {
+	_micros = 0;
+	_step = step;
+	_millis = 0;
+	_fraction = 0;
+}
+
+void RegloVirtualClock::tick(unsigned long micros) {
+	_micros += micros;
+	_fraction += micros % 1000;
+	_millis += micros / 1000 + _fraction / 1000;
+	_fraction %= 1000;
+}
+
+unsigned long RegloVirtualClock::millis() {
+	return _millis;
+}
+
+unsigned long RegloVirtualClock::micros() {
+	return _micros;
+}
+
+void RegloVirtualClock::wait() {
+	tick(_step);
+}
+
+void RegloVirtualClock::advance(unsigned long micros) {
+	tick(micros);
+}
@@ -0,0 +1,101 @@
+/**
+ * @file RegloClock.h
+ *
+ * Time source for pump communication.
+ */
+
+#ifndef REGLO_CLOCK_H
+#define REGLO_CLOCK_H
+
+/**
+ * Time source used for response timeouts, deadlines and timing reports.
+ *
+ * The base class reads the board's millis() and micros() and busy-waits.
+ * Derive from it to run the library against simulated time.
+ */
+class RegloClock {
+
+public:
+
+	/**
+	 * Milliseconds since an arbitrary origin, wrapping like millis().
+	 */
+	virtual unsigned long millis();
+
+	/**
+	 * Microseconds since an arbitrary origin, wrapping like micros().
+	 */
+	virtual unsigned long micros();
+
+	/**
+	 * Let time pass while waiting for a response.
+	 */
+	virtual void wait();
+
+};
+
+/**
+ * Clock that only moves when told to, for running simulations faster than
+ * real time.
+ *
+ * Each wait() advances the clock by a fixed step, so blocking calls reach
+ * their timeouts without any real time passing.
+ */
+class RegloVirtualClock : public RegloClock {
+
+	unsigned long _micros;
+	unsigned long _step;
+
+	// Milliseconds are counted on their own, as _micros / 1000 would jump
+	// back when _micros wraps around after about 71 minutes.
+	unsigned long _millis;
+	unsigned long _fraction;
+
+	/**
+	 * Move both counters forward.
+	 */
+	void tick(unsigned long micros);
+
+public:
+
+	/**
+	 * Construct a new virtual clock at time zero.
+	 *
+	 * @param[in] step      Microseconds advanced by each wait().
+	 */
+	RegloVirtualClock(unsigned long step = 100);
+
+	virtual unsigned long millis();
+	virtual unsigned long micros();
+	virtual void wait();
+
+	/**
+	 * Move the clock forward.
+	 */
+	void advance(unsigned long micros);
+
+};
+
+/**
+ * The board's clock, sleeping the CPU instead of spinning while waiting.
+ *
+ * On AVR each wait() enters idle sleep, which the UART receive interrupt
+ * ends as soon as a byte arrives, and the millis() timer at the latest
+ * about a millisecond later, so timeouts stay accurate. ARM boards wait
+ * for any interrupt, other boards yield(). A byte that arrives just before
+ * the sleep starts is seen one timer tick later at most.
+ */
+class RegloSleepClock : public RegloClock {
+
+public:
+
+	virtual void wait();
+
+};
+
+/**
+ * The board's clock, used unless another one is set.
+ */
+extern RegloClock RegloSystemClock;
+
+#endif
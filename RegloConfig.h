@@ -0,0 +1,118 @@
+/**
+ * @file RegloConfig.h
+ *
+ * Build configuration of the Reglo-CPF library.
+ *
+ * Each setting may be overridden by defining it for the whole build, e.g.
+ * with a -D compiler flag, so the library and the sketch agree.
+ */
+
+#ifndef REGLO_CONFIG_H
+#define REGLO_CONFIG_H
+
+/**
+ * Flow rate commands, normalization and limits. Without them no floating
+ * point or scanf code is linked.
+ */
+#ifndef REGLO_ENABLE_FLOW_RATE
+#define REGLO_ENABLE_FLOW_RATE 1
+#endif
+
+/**
+ * Control panel commands.
+ */
+#ifndef REGLO_ENABLE_CONTROL_PANEL
+#define REGLO_ENABLE_CONTROL_PANEL 1
+#endif
+
+/**
+ * Counters of commands and stray bytes on each RegloBus.
+ */
+#ifndef REGLO_ENABLE_STATS
+#define REGLO_ENABLE_STATS 1
+#endif
+
+/**
+ * On AVR, release the driver of a RegloRS485 on a hardware serial port
+ * from the UART's transmit complete interrupt. Turn off if the sketch
+ * handles USART_TX_vect or USARTn_TX_vect itself.
+ */
+#ifndef REGLO_ENABLE_RS485_INTERRUPT
+#define REGLO_ENABLE_RS485_INTERRUPT 1
+#endif
+
+/**
+ * Milliseconds a pump is given to start responding to a request, and
+ * then to send each further byte of its response.
+ */
+#ifndef REGLO_RESPONSE_TIMEOUT
+#define REGLO_RESPONSE_TIMEOUT 100
+#endif
+
+/**
+ * Microseconds a pump on a RegloBus is first given between its response
+ * and its next request. The bus adapts the pause of each pump from there.
+ */
+#ifndef REGLO_COMMAND_GAP
+#define REGLO_COMMAND_GAP 1000
+#endif
+
+/**
+ * Milliseconds RegloBus::scan() waits for an address to start responding
+ * before taking it to be unused.
+ */
+#ifndef REGLO_PROBE_TIMEOUT
+#define REGLO_PROBE_TIMEOUT 25
+#endif
+
+/**
+ * SRAM budget of one RegloCPF, in bytes on AVR.
+ */
+#ifndef REGLO_PUMP_SIZE_BUDGET
+#define REGLO_PUMP_SIZE_BUDGET 24
+#endif
+
+/**
+ * SRAM budget of one RegloBus, in bytes on AVR. The counters of
+ * REGLO_ENABLE_STATS are budgeted on top of it.
+ */
+#ifndef REGLO_BUS_SIZE_BUDGET
+#define REGLO_BUS_SIZE_BUDGET 64
+#endif
+
+/**
+ * Budget for the local buffers of any one library function, in bytes on
+ * AVR. The compiler only checks the buffers each function declares;
+ * extras/footprint.py checks the whole stack frames it measures.
+ */
+#ifndef REGLO_STACK_BUDGET
+#define REGLO_STACK_BUDGET 128
+#endif
+
+/**
+ * Budget for the stack of a library call with everything it calls, in
+ * bytes on AVR, checked by extras/footprint.py. Calls through Stream and
+ * callbacks come on top.
+ */
+#ifndef REGLO_CALL_STACK_BUDGET
+#define REGLO_CALL_STACK_BUDGET 256
+#endif
+
+/**
+ * Fail the build if a type outgrows its SRAM budget, or the local buffers
+ * of a function exceed the stack budget. Only checked on AVR, which the
+ * budgets are for.
+ */
+#if defined(__AVR__)
+#define REGLO_SIZE_CHECK(type, budget) \
+	static_assert(sizeof(type) <= (budget), \
+			#type " exceeds " #budget ", see RegloConfig.h")
+#define REGLO_STACK_CHECK(size) \
+	static_assert((size) <= REGLO_STACK_BUDGET, \
+			"local buffers exceed REGLO_STACK_BUDGET, see RegloConfig.h")
+#else
+#define REGLO_SIZE_CHECK(type, budget)
+#define REGLO_STACK_CHECK(size)
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * @file RegloCoroutine.h
+ *
+ * C++20 coroutines over RegloBus, for host builds.
+ *
+ * A pump workflow is written as a coroutine returning RegloTask that
+ * co_awaits pump commands in sequence:
+ *
+ *     RegloTask dose(RegloCPF* pump) {
+ *         int mantisse = 2000, exponent = -3;
+ *         if (co_await reglo_set_flow_rate(pump, &mantisse, &exponent)
+ *                 != REGLO_OK) {
+ *             co_return;
+ *         }
+ *         co_await reglo_start(pump);
+ *     }
+ *
+ * Each co_await queues a command on the pump's bus and suspends until it
+ * finishes, so any number of workflows share one thread, advanced by
+ * RegloBus::poll(). Workflows resume from inside poll(), and should end
+ * once a command returns REGLO_ABORTED: an aborted bus refuses every
+ * command but stops at once, without suspending.
+ */
+
+#ifndef REGLO_COROUTINE_H
+#define REGLO_COROUTINE_H
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+
+#include "RegloBus.h"
+
+/**
+ * Detached pump workflow, running from its call until its end.
+ */
+struct RegloTask {
+
+	struct promise_type {
+		RegloTask get_return_object() {
+			return RegloTask();
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return std::suspend_never();
+		}
+		std::suspend_never final_suspend() noexcept {
+			return std::suspend_never();
+		}
+		void return_void() {
+		}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+
+};
+
+/**
+ * A pump command to co_await, resuming with its REGLO_* status.
+ *
+ * The command lives in the awaiting coroutine's frame while it is queued.
+ */
+class RegloAwaitable {
+
+	RegloCommand _command;
+	int* _mantisse;
+	int* _exponent;
+	std::coroutine_handle<> _waiter;
+
+	static void finished(RegloCommand* command) {
+		RegloAwaitable* awaitable = (RegloAwaitable*) command->context;
+		awaitable->_waiter.resume();
+	}
+
+public:
+
+	RegloAwaitable(RegloCPF* pump, uint8_t command, int* mantisse = NULL,
+			int* exponent = NULL, uint8_t priority = REGLO_PRIORITY_NORMAL) :
+			_command(pump, command, priority) {
+		_mantisse = mantisse;
+		_exponent = exponent;
+		if (command == REGLO_COMMAND_SET_FLOW_RATE) {
+			_command.mantisse = *mantisse;
+			_command.exponent = *exponent;
+		}
+	}
+
+	bool await_ready() {
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> waiter) {
+		_waiter = waiter;
+		_command.callback = finished;
+		_command.context = this;
+		RegloBus* bus = _command.pump->_bus;
+		int status = (bus != NULL) ? bus->submit(&_command) : REGLO_ERROR;
+		if (status != REGLO_OK) {
+			_command.status = status;
+			return false;
+		}
+		return true;
+	}
+
+	int await_resume() {
+		// Like the blocking call, a rejected rate hands back what the pump
+		// echoed instead.
+		if (_mantisse != NULL && (_command.status == REGLO_OK
+				|| (_command.status == REGLO_BAD_RESPONSE
+						&& _command.command == REGLO_COMMAND_SET_FLOW_RATE))) {
+			*_mantisse = _command.mantisse;
+			*_exponent = _command.exponent;
+		}
+		return _command.status;
+	}
+
+};
+
+/**
+ * Start a pump attached to a bus, see RegloCPF::start().
+ */
+inline RegloAwaitable reglo_start(RegloCPF* pump) {
+	return RegloAwaitable(pump, REGLO_COMMAND_START);
+}
+
+/**
+ * Stop a pump attached to a bus, see RegloCPF::stop().
+ */
+inline RegloAwaitable reglo_stop(RegloCPF* pump) {
+	return RegloAwaitable(pump, REGLO_COMMAND_STOP, NULL, NULL,
+			REGLO_PRIORITY_HIGH);
+}
+
+#if REGLO_ENABLE_FLOW_RATE
+/**
+ * Get the flow rate of a pump attached to a bus, see
+ * RegloCPF::get_flow_rate().
+ */
+inline RegloAwaitable reglo_get_flow_rate(RegloCPF* pump, int* mantisse,
+		int* exponent) {
+	return RegloAwaitable(pump, REGLO_COMMAND_GET_FLOW_RATE, mantisse,
+			exponent);
+}
+
+/**
+ * Set the flow rate of a pump attached to a bus, see
+ * RegloCPF::set_flow_rate(), leaving the echoed rate in the parameters on
+ * REGLO_OK and REGLO_BAD_RESPONSE.
+ */
+inline RegloAwaitable reglo_set_flow_rate(RegloCPF* pump, int* mantisse,
+		int* exponent) {
+	return RegloAwaitable(pump, REGLO_COMMAND_SET_FLOW_RATE, mantisse,
+			exponent);
+}
+#endif
+
+#endif
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * @file RegloPoller.cpp
+ *
+ * Background flow rate polling of the pumps on a RegloBus.
+ */
+
+#include "RegloPoller.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+// Bytes on the line per query, "1f\r" and e.g. "3600E-2\r\n".
+const unsigned long QUERY_BYTES = 3 + REGLO_RAW_RESPONSE_SIZE;
+
+// Queries worth of credit that may be saved up while the line is idle.
+const unsigned long CREDIT_QUERIES = 2;
+
+RegloPoller::RegloPoller(RegloBus* bus, uint8_t ceiling) {
+	_bus = bus;
+	memset(_watches, 0, sizeof(_watches));
+	_query.priority = REGLO_PRIORITY_LOW;
+	_query.command = REGLO_COMMAND_GET_FLOW_RATE;
+	_query.callback = received;
+	_query.context = this;
+	_polling = 0;
+	_credit = 0;
+	_credited = 0;
+	set_ceiling(ceiling);
+}
+
+int RegloPoller::watch(uint8_t address, uint16_t min_interval,
+		uint16_t max_interval) {
+	if (_bus->pump(address) == NULL) {
+		return REGLO_ERROR;
+	}
+	if (min_interval == 0 || max_interval < min_interval) {
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	Watch* watch = &_watches[address - 1];
+	watch->min_interval = min_interval;
+	watch->max_interval = max_interval;
+	watch->known = false;
+	refresh(address);
+	return REGLO_OK;
+}
+
+void RegloPoller::unwatch(uint8_t address) {
+	if (address >= 1 && address <= REGLO_MAX_PUMPS) {
+		_watches[address - 1].min_interval = 0;
+	}
+}
+
+void RegloPoller::refresh(uint8_t address) {
+	if (address < 1 || address > REGLO_MAX_PUMPS) {
+		return;
+	}
+	Watch* watch = &_watches[address - 1];
+	watch->interval = watch->min_interval;
+	watch->polled = _bus->_clock->millis() - watch->interval;
+}
+
+void RegloPoller::set_ceiling(uint8_t ceiling) {
+	_ceiling = (ceiling < 1) ? 1 : (ceiling > 100) ? 100 : ceiling;
+}
+
+unsigned long RegloPoller::cost() {
+	return QUERY_BYTES * _bus->_byte_time;
+}
+
+void RegloPoller::poll() {
+	// Credit accrues at the ceiling's share of the time passed.
+	unsigned long now = _bus->_clock->micros();
+	unsigned long limit = CREDIT_QUERIES * cost();
+	unsigned long elapsed = now - _credited;
+	if (elapsed >= limit * 100 / _ceiling) {
+		_credit = limit;
+		_credited = now;
+	} else {
+		unsigned long earned = elapsed * _ceiling / 100;
+		_credit = (earned >= limit - _credit) ? limit : _credit + earned;
+		_credited += earned * 100 / _ceiling;
+	}
+
+	if (!_query.done() || _credit < cost()) {
+		return;
+	}
+
+	// Query the pump that is most overdue.
+	unsigned long moment = _bus->_clock->millis();
+	uint8_t next = REGLO_MAX_PUMPS;
+	unsigned long overdue = 0;
+	for (uint8_t i = 0; i < REGLO_MAX_PUMPS; i++) {
+		Watch* watch = &_watches[i];
+		if (watch->min_interval == 0) {
+			continue;
+		}
+		unsigned long waited = moment - watch->polled;
+		if (waited >= watch->interval && (next == REGLO_MAX_PUMPS
+				|| waited - watch->interval > overdue)) {
+			next = i;
+			overdue = waited - watch->interval;
+		}
+	}
+	if (next == REGLO_MAX_PUMPS) {
+		return;
+	}
+
+	_query.pump = _bus->pump(next + 1);
+	if (_query.pump == NULL || _bus->submit(&_query) != REGLO_OK) {
+		return;
+	}
+	_polling = next;
+	_watches[next].polled = moment;
+	_credit -= cost();
+}
+
+void RegloPoller::received(RegloCommand* command) {
+	RegloPoller* poller = (RegloPoller*) command->context;
+	Watch* watch = &poller->_watches[poller->_polling];
+	if (watch->min_interval == 0) {
+		return;
+	}
+
+	// Speed up after a change, back off while nothing changes or the pump
+	// does not answer.
+	bool changed = command->status == REGLO_OK
+			&& (!watch->known || command->mantisse != watch->mantisse
+					|| command->exponent != watch->exponent);
+	if (changed) {
+		watch->interval = watch->min_interval;
+	} else if (watch->interval > watch->max_interval / 2) {
+		watch->interval = watch->max_interval;
+	} else {
+		watch->interval *= 2;
+	}
+
+	if (command->status == REGLO_OK) {
+		watch->mantisse = command->mantisse;
+		watch->exponent = command->exponent;
+		watch->updated = poller->_bus->_clock->millis();
+		watch->known = true;
+	}
+}
+
+int RegloPoller::flow_rate(uint8_t address, int* mantisse, int* exponent,
+		unsigned long* age) {
+	if (address < 1 || address > REGLO_MAX_PUMPS) {
+		return REGLO_OUT_OF_RANGE;
+	}
+	Watch* watch = &_watches[address - 1];
+	if (!watch->known) {
+		return REGLO_ERROR;
+	}
+	*mantisse = watch->mantisse;
+	*exponent = watch->exponent;
+	if (age != NULL) {
+		*age = _bus->_clock->millis() - watch->updated;
+	}
+	return REGLO_OK;
+}
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * @file RegloPoller.h
+ *
+ * Background flow rate polling of the pumps on a RegloBus.
+ */
+
+#ifndef REGLO_POLLER_H
+#define REGLO_POLLER_H
+
+#include "RegloBus.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+/**
+ * Keeps the flow rates of the pumps on a bus up to date.
+ *
+ * Queries are queued at REGLO_PRIORITY_LOW, one at a time, so commands
+ * never wait behind more than one of them. Each pump is polled at its
+ * shortest interval after a change, and half as often each time its rate
+ * is found unchanged, down to its longest interval. Polling uses at most a
+ * set share of the line, whatever the intervals ask for.
+ */
+class RegloPoller {
+
+	struct Watch {
+		uint16_t min_interval;  // Milliseconds, 0 if not watched.
+		uint16_t max_interval;
+		uint16_t interval;      // Current interval between queries.
+		unsigned long polled;   // Clock time of the last query.
+		unsigned long updated;  // Clock time the rate was last received.
+		int mantisse;
+		int exponent;
+		bool known;
+	};
+
+	RegloBus* _bus;
+	Watch _watches[REGLO_MAX_PUMPS];
+	RegloCommand _query;
+	uint8_t _polling;           // Index of the pump _query was sent to.
+	uint8_t _ceiling;
+
+	// Line time polling may still use, in microseconds, and when it was
+	// last topped up.
+	unsigned long _credit;
+	unsigned long _credited;
+
+	/**
+	 * Handle the response to a query, see RegloCommand::callback.
+	 */
+	static void received(RegloCommand* command);
+
+	/**
+	 * Line time of one query and its response, in microseconds.
+	 */
+	unsigned long cost();
+
+public:
+
+	/**
+	 * Construct a poller for the pumps attached to a bus.
+	 *
+	 * @param[in] bus       Bus to poll, its poll() must still be called.
+	 * @param[in] ceiling   Percentage of the line polling may use.
+	 */
+	RegloPoller(RegloBus* bus, uint8_t ceiling = 25);
+
+	/**
+	 * Poll an attached pump.
+	 *
+	 * @param[in] address       Address of the pump.
+	 * @param[in] min_interval  Milliseconds between queries after a change.
+	 * @param[in] max_interval  Milliseconds between queries of a steady
+	 *                          pump, at least min_interval.
+	 */
+	int watch(uint8_t address, uint16_t min_interval, uint16_t max_interval);
+
+	/**
+	 * Stop polling a pump.
+	 */
+	void unwatch(uint8_t address);
+
+	/**
+	 * Poll a pump as soon as possible and then at its shortest interval,
+	 * e.g. after changing its setpoint.
+	 */
+	void refresh(uint8_t address);
+
+	/**
+	 * Set the percentage of the line polling may use, 1 to 100.
+	 */
+	void set_ceiling(uint8_t ceiling);
+
+	/**
+	 * Queue the next query that is due, without blocking.
+	 *
+	 * Call this frequently, e.g. from loop() next to RegloBus::poll().
+	 */
+	void poll();
+
+	/**
+	 * Get the last flow rate received from a pump.
+	 *
+	 * @param[out] age  Milliseconds since it was received, may be NULL.
+	 * @return REGLO_ERROR until a rate has been received.
+	 */
+	int flow_rate(uint8_t address, int* mantisse, int* exponent,
+			unsigned long* age = NULL);
+
+};
+
+#endif
+
+#endif
@@ -0,0 +1,485 @@
+/**
+ * @file RegloProgram.cpp
+ *
+ * Pump programs as compact bytecode, run without blocking.
+ */
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#endif
+#include "RegloProgram.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+// Progress of a program.
+enum {
+	STATE_IDLE,
+	STATE_READY,
+	STATE_COMMAND,
+	STATE_SLEEP,
+	STATE_YIELD
+};
+
+// Steps of a dispense, after its start has been queued.
+enum {
+	DISPENSE_NONE,
+	DISPENSE_STARTING,
+	DISPENSE_RUNNING
+};
+
+// Milliseconds per minute, flow rates are per minute.
+const unsigned long MINUTE = 60000;
+
+RegloProgram::RegloProgram(RegloBus* bus, RegloCPF* pump) :
+		_command(pump) {
+	_bus = bus;
+	_pump = pump;
+	_code = NULL;
+	_length = 0;
+	_memory = REGLO_PROGRAM_RAM;
+	_pc = 0;
+	_state = STATE_IDLE;
+	_status = REGLO_OK;
+	_since = 0;
+	_duration = 0;
+	_dispense = DISPENSE_NONE;
+	_depth = 0;
+	_mantisse = 0;
+	_exponent = 0;
+	_rated = false;
+}
+
+uint8_t RegloProgram::fetch(uint16_t pc) {
+#if defined(__AVR__)
+	if (_memory == REGLO_PROGRAM_FLASH) {
+		return pgm_read_byte(_code + pc);
+	}
+	if (_memory == REGLO_PROGRAM_EEPROM) {
+		return eeprom_read_byte(_code + pc);
+	}
+#endif
+	return _code[pc];
+}
+
+uint16_t RegloProgram::fetch_word(uint16_t pc) {
+	return fetch(pc) | (uint16_t) fetch(pc + 1) << 8;
+}
+
+uint8_t RegloProgram::size(uint8_t op) {
+	switch (op) {
+	case REGLO_OP_END:
+	case REGLO_OP_CLOCKWISE:
+	case REGLO_OP_COUNTER_CLOCKWISE:
+	case REGLO_OP_START:
+	case REGLO_OP_STOP:
+	case REGLO_OP_NEXT:
+		return 1;
+	case REGLO_OP_LOOP:
+		return 2;
+	case REGLO_OP_WAIT:
+	case REGLO_OP_WAIT_SECONDS:
+		return 3;
+	case REGLO_OP_RATE:
+	case REGLO_OP_DISPENSE:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+int RegloProgram::load(const uint8_t* code, uint16_t length, uint8_t memory) {
+	cancel();
+	_code = code;
+	_length = length;
+	_memory = memory;
+
+	// Every instruction must be whole and every loop closed.
+	uint8_t depth = 0;
+	uint16_t pc = 0;
+	while (pc < length) {
+		uint8_t op = fetch(pc);
+		uint8_t bytes = size(op);
+		if (bytes == 0 || pc + bytes > length) {
+			_code = NULL;
+			return REGLO_OUT_OF_RANGE;
+		}
+		if (op == REGLO_OP_LOOP && depth++ == REGLO_PROGRAM_DEPTH) {
+			_code = NULL;
+			return REGLO_OUT_OF_RANGE;
+		}
+		if (op == REGLO_OP_NEXT && depth-- == 0) {
+			_code = NULL;
+			return REGLO_OUT_OF_RANGE;
+		}
+		if (op == REGLO_OP_END) {
+			break;
+		}
+		pc += bytes;
+	}
+	if (depth != 0) {
+		_code = NULL;
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	_state = STATE_READY;
+	return REGLO_OK;
+}
+
+bool RegloProgram::run() {
+	for (;;) {
+		switch (_state) {
+		case STATE_IDLE:
+			return false;
+		case STATE_COMMAND:
+			if (!_command.done()) {
+				return true;
+			}
+			if (_command.status != REGLO_OK) {
+				return finish(_command.status);
+			}
+			if (_command.command == REGLO_COMMAND_SET_FLOW_RATE) {
+				_mantisse = _command.mantisse;
+				_exponent = _command.exponent;
+				_rated = true;
+			}
+			_state = STATE_READY;
+			break;
+		case STATE_SLEEP:
+			if (_bus->_clock->millis() - _since < _duration) {
+				return true;
+			}
+			_state = STATE_READY;
+			break;
+		case STATE_YIELD:
+			_state = STATE_READY;
+			break;
+		default:
+			// A command abandoned by cancel() may still be on the line.
+			if (!_command.done()) {
+				return true;
+			}
+			break;
+		}
+
+		// A dispense runs its pump for the time its volume takes.
+		if (_dispense == DISPENSE_STARTING) {
+			_dispense = DISPENSE_RUNNING;
+			sleep(_duration);
+		} else if (_dispense == DISPENSE_RUNNING) {
+			_dispense = DISPENSE_NONE;
+			issue(REGLO_COMMAND_STOP);
+		} else {
+			step();
+			if (_state == STATE_YIELD) {
+				return true;
+			}
+		}
+	}
+}
+
+void RegloProgram::step() {
+	if (_pc >= _length) {
+		finish(REGLO_OK);
+		return;
+	}
+
+	uint8_t op = fetch(_pc);
+	uint16_t pc = _pc;
+	_pc += size(op);
+
+	switch (op) {
+	case REGLO_OP_RATE:
+		_command.mantisse = (int16_t) fetch_word(pc + 1);
+		_command.exponent = (int8_t) fetch(pc + 3);
+		issue(REGLO_COMMAND_SET_FLOW_RATE);
+		break;
+	case REGLO_OP_CLOCKWISE:
+		issue(REGLO_COMMAND_CLOCKWISE);
+		break;
+	case REGLO_OP_COUNTER_CLOCKWISE:
+		issue(REGLO_COMMAND_COUNTER_CLOCKWISE);
+		break;
+	case REGLO_OP_START:
+		issue(REGLO_COMMAND_START);
+		break;
+	case REGLO_OP_STOP:
+		issue(REGLO_COMMAND_STOP);
+		break;
+	case REGLO_OP_WAIT:
+		sleep(fetch_word(pc + 1));
+		break;
+	case REGLO_OP_WAIT_SECONDS:
+		sleep(fetch_word(pc + 1) * 1000UL);
+		break;
+	case REGLO_OP_LOOP:
+		_loops[_depth].start = _pc;
+		_loops[_depth].remaining = fetch(pc + 1);
+		_depth++;
+		break;
+	case REGLO_OP_NEXT: {
+			// A count of 0 repeats for ever. Each round returns to the
+			// caller, so a loop that takes no time cannot hang it.
+			Loop* loop = &_loops[_depth - 1];
+			if (loop->remaining == 0 || --loop->remaining > 0) {
+				_pc = loop->start;
+				_state = STATE_YIELD;
+			} else {
+				_depth--;
+			}
+			break;
+		}
+	case REGLO_OP_DISPENSE: {
+			int mantisse = (int16_t) fetch_word(pc + 1);
+			int exponent = (int8_t) fetch(pc + 3);
+			if (!_rated || _mantisse == 0
+					|| RegloCPF::normalize_flow_rate(&mantisse, &exponent)
+							!= REGLO_OK) {
+				finish(REGLO_OUT_OF_RANGE);
+				break;
+			}
+
+			// Minutes are volume over rate, kept to four digits before
+			// scaling by the difference of the exponents. Digits scaled away
+			// are dropped and only the last is rounded, as rounding each in
+			// turn can carry up; the quotient is left unrounded for that.
+			int scale = exponent - _exponent;
+			unsigned long time = (mantisse * MINUTE
+					+ ((scale < 0) ? 0 : _mantisse / 2)) / _mantisse;
+			while (scale != 0) {
+				if (scale > 0) {
+					if (time > 0xFFFFFFFFUL / 10) {
+						finish(REGLO_OUT_OF_RANGE);
+						return;
+					}
+					time *= 10;
+					scale--;
+				} else {
+					time = (scale < -1) ? time / 10 : (time + 5) / 10;
+					scale++;
+				}
+			}
+			if (time == 0) {
+				break;
+			}
+			_duration = time;
+			_dispense = DISPENSE_STARTING;
+			issue(REGLO_COMMAND_START);
+			break;
+		}
+	default:
+		finish(REGLO_OK);
+		break;
+	}
+}
+
+void RegloProgram::issue(uint8_t command) {
+	_command.command = command;
+	int status = _bus->submit(&_command);
+	if (status != REGLO_OK) {
+		finish(status);
+		return;
+	}
+	_state = STATE_COMMAND;
+}
+
+void RegloProgram::sleep(unsigned long duration) {
+	_since = _bus->_clock->millis();
+	_duration = duration;
+	_state = STATE_SLEEP;
+}
+
+bool RegloProgram::finish(int status) {
+	_status = status;
+	_state = STATE_IDLE;
+	_dispense = DISPENSE_NONE;
+	return false;
+}
+
+void RegloProgram::cancel() {
+	_bus->withdraw(&_command);
+	_state = STATE_IDLE;
+	_status = REGLO_OK;
+	_pc = 0;
+	_depth = 0;
+	_dispense = DISPENSE_NONE;
+	_rated = false;
+}
+
+int RegloProgram::status() {
+	return _status;
+}
+
+uint16_t RegloProgram::position() {
+	return _pc;
+}
+
+/**
+ * Skip spaces and tabs.
+ */
+static const char* skip(const char* c) {
+	while (*c == ' ' || *c == '\t') {
+		c++;
+	}
+	return c;
+}
+
+/**
+ * Parse a decimal integer within bounds.
+ */
+static const char* number(const char* c, long min, long max, long* value) {
+	c = skip(c);
+	bool negative = (*c == '-');
+	if (*c == '-' || *c == '+') {
+		c++;
+	}
+	if (*c < '0' || *c > '9') {
+		return NULL;
+	}
+	long result = 0;
+	while (*c >= '0' && *c <= '9') {
+		result = result * 10 + (*c++ - '0');
+		if (result > 100000000L) {
+			return NULL;
+		}
+	}
+	if (negative) {
+		result = -result;
+	}
+	if (result < min || result > max) {
+		return NULL;
+	}
+	*value = result;
+	return c;
+}
+
+/**
+ * Match a mnemonic as a whole word.
+ */
+static const char* keyword(const char* c, const char* mnemonic) {
+	while (*mnemonic != '\0') {
+		if (*c++ != *mnemonic++) {
+			return NULL;
+		}
+	}
+	if (*c != ' ' && *c != '\t' && *c != '#' && *c != '\r' && *c != '\n'
+			&& *c != '\0') {
+		return NULL;
+	}
+	return c;
+}
+
+int RegloProgram::assemble(const char* source, uint8_t* code, uint16_t size,
+		uint16_t* length) {
+	uint16_t pc = 0;
+	uint16_t line = 0;
+	uint8_t depth = 0;
+
+	const char* c = source;
+	while (*c != '\0') {
+		line++;
+		c = skip(c);
+
+		uint8_t op;
+		long first = 0;
+		long second = 0;
+		const char* rest;
+		if (*c == '#' || *c == '\r' || *c == '\n' || *c == '\0') {
+			op = 0xFF;
+			rest = c;
+		} else if ((rest = keyword(c, "rate")) != NULL) {
+			op = REGLO_OP_RATE;
+			rest = number(rest, 0, 32767, &first);
+			rest = (rest != NULL) ? number(rest, -9, 9, &second) : NULL;
+		} else if ((rest = keyword(c, "dispense")) != NULL) {
+			op = REGLO_OP_DISPENSE;
+			rest = number(rest, 0, 32767, &first);
+			rest = (rest != NULL) ? number(rest, -9, 9, &second) : NULL;
+		} else if ((rest = keyword(c, "clockwise")) != NULL) {
+			op = REGLO_OP_CLOCKWISE;
+		} else if ((rest = keyword(c, "counterclockwise")) != NULL) {
+			op = REGLO_OP_COUNTER_CLOCKWISE;
+		} else if ((rest = keyword(c, "start")) != NULL) {
+			op = REGLO_OP_START;
+		} else if ((rest = keyword(c, "stop")) != NULL) {
+			op = REGLO_OP_STOP;
+		} else if ((rest = keyword(c, "wait")) != NULL) {
+			// Longer waits take whole seconds, and a wait for the
+			// milliseconds left over.
+			rest = number(rest, 0, 65535999L, &first);
+			if (first > 65535) {
+				op = REGLO_OP_WAIT_SECONDS;
+				second = first % 1000;
+				first /= 1000;
+			} else {
+				op = REGLO_OP_WAIT;
+			}
+		} else if ((rest = keyword(c, "loop")) != NULL) {
+			op = REGLO_OP_LOOP;
+			rest = number(rest, 0, 255, &first);
+			rest = (depth++ < REGLO_PROGRAM_DEPTH) ? rest : NULL;
+		} else if ((rest = keyword(c, "next")) != NULL) {
+			op = REGLO_OP_NEXT;
+			rest = (depth-- > 0) ? rest : NULL;
+		} else if ((rest = keyword(c, "end")) != NULL) {
+			op = REGLO_OP_END;
+		} else {
+			rest = NULL;
+		}
+
+		// Nothing but a comment may follow the instruction.
+		if (rest != NULL) {
+			rest = skip(rest);
+			if (*rest == '#') {
+				while (*rest != '\0' && *rest != '\n') {
+					rest++;
+				}
+			}
+			if (*rest == '\r') {
+				rest++;
+			}
+		}
+		if (rest == NULL || (*rest != '\n' && *rest != '\0')) {
+			*length = line;
+			return REGLO_ERROR;
+		}
+		c = (*rest == '\n') ? rest + 1 : rest;
+
+		if (op == 0xFF) {
+			continue;
+		}
+		uint8_t bytes = RegloProgram::size(op);
+		uint8_t remainder = (op == REGLO_OP_WAIT_SECONDS && second != 0)
+				? RegloProgram::size(REGLO_OP_WAIT) : 0;
+		if (pc + bytes + remainder > size) {
+			*length = line;
+			return REGLO_OUT_OF_RANGE;
+		}
+		code[pc] = op;
+		if (bytes >= 3) {
+			code[pc + 1] = (uint16_t) first & 0xFF;
+			code[pc + 2] = (uint16_t) first >> 8;
+		} else if (bytes == 2) {
+			code[pc + 1] = (uint8_t) first;
+		}
+		if (bytes == 4) {
+			code[pc + 3] = (uint8_t) (int8_t) second;
+		}
+		pc += bytes;
+		if (remainder != 0) {
+			code[pc] = REGLO_OP_WAIT;
+			code[pc + 1] = (uint16_t) second & 0xFF;
+			code[pc + 2] = (uint16_t) second >> 8;
+			pc += remainder;
+		}
+	}
+
+	if (depth != 0) {
+		*length = line;
+		return REGLO_ERROR;
+	}
+	*length = pc;
+	return REGLO_OK;
+}
+
+#endif
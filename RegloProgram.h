@@ -0,0 +1,192 @@
+/**
+ * @file RegloProgram.h
+ *
+ * Pump programs as compact bytecode, run without blocking.
+ */
+
+#ifndef REGLO_PROGRAM_H
+#define REGLO_PROGRAM_H
+
+#include "RegloBus.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+/**
+ * Where a program's bytecode is stored.
+ */
+enum {
+	REGLO_PROGRAM_RAM,
+	REGLO_PROGRAM_FLASH,        //!< PROGMEM on AVR, RAM elsewhere.
+	REGLO_PROGRAM_EEPROM        //!< EEPROM address on AVR, RAM elsewhere.
+};
+
+/**
+ * Program instructions, each followed by its operands, little endian.
+ */
+enum {
+	REGLO_OP_END,               //!< End of program.
+	REGLO_OP_RATE,              //!< int16 mantissa, int8 exponent, ml/min.
+	REGLO_OP_CLOCKWISE,
+	REGLO_OP_COUNTER_CLOCKWISE,
+	REGLO_OP_START,
+	REGLO_OP_STOP,
+	REGLO_OP_WAIT,              //!< uint16 milliseconds.
+	REGLO_OP_WAIT_SECONDS,      //!< uint16 seconds, for waits of over 65535 ms.
+	REGLO_OP_LOOP,              //!< uint8 count, 0 for ever, up to NEXT.
+	REGLO_OP_NEXT,
+	REGLO_OP_DISPENSE           //!< int16 mantissa, int8 exponent, ml.
+};
+
+/**
+ * Depth to which loops may be nested.
+ */
+const uint8_t REGLO_PROGRAM_DEPTH = 2;
+
+/**
+ * Runs a program on a pump attached to a bus.
+ *
+ * Programs are written as text, one instruction per line and '#' for
+ * comments, and assembled to bytecode, e.g. on the host:
+ *
+ *     rate 2000 -3        # 2 ml/min
+ *     clockwise
+ *     loop 3
+ *       dispense 5000 -3  # 5 ml at the current rate
+ *       wait 10000        # milliseconds
+ *     next
+ *
+ * Commands are queued on the bus, so any number of programs run
+ * interleaved, advanced by run() next to RegloBus::poll().
+ */
+class RegloProgram {
+
+	struct Loop {
+		uint16_t start;
+		uint8_t remaining;
+	};
+
+	RegloBus* _bus;
+	RegloCPF* _pump;
+	RegloCommand _command;
+
+	const uint8_t* _code;
+	uint16_t _length;
+	uint8_t _memory;
+	uint16_t _pc;
+
+	uint8_t _state;
+	int _status;
+	unsigned long _since;
+	unsigned long _duration;
+	uint8_t _dispense;
+	uint8_t _depth;
+	Loop _loops[REGLO_PROGRAM_DEPTH];
+
+	// Rate confirmed by the pump, for dispensing.
+	int _mantisse;
+	int _exponent;
+	bool _rated;
+
+	/**
+	 * Read a byte of the program.
+	 */
+	uint8_t fetch(uint16_t pc);
+
+	/**
+	 * Read a little endian word of the program.
+	 */
+	uint16_t fetch_word(uint16_t pc);
+
+	/**
+	 * Number of bytes of an instruction with its operands, 0 if unknown.
+	 */
+	static uint8_t size(uint8_t op);
+
+	/**
+	 * Queue a command for the pump.
+	 */
+	void issue(uint8_t command);
+
+	/**
+	 * Return to the caller for a while.
+	 */
+	void sleep(unsigned long duration);
+
+	/**
+	 * End the program with a status.
+	 */
+	bool finish(int status);
+
+	/**
+	 * Execute the next instruction.
+	 */
+	void step();
+
+public:
+
+	/**
+	 * Construct an idle program runner for an attached pump.
+	 */
+	RegloProgram(RegloBus* bus, RegloCPF* pump);
+
+	/**
+	 * Check and load a program, to run from its start.
+	 *
+	 * @param[in] code      Bytecode, which must stay in place while it runs.
+	 * @param[in] length    Number of bytes.
+	 * @param[in] memory    One of REGLO_PROGRAM_*.
+	 * @return REGLO_OUT_OF_RANGE if the bytecode is malformed.
+	 */
+	int load(const uint8_t* code, uint16_t length,
+			uint8_t memory = REGLO_PROGRAM_RAM);
+
+	/**
+	 * Advance the program, without blocking.
+	 *
+	 * Returns after each round of a loop at the latest, so even a loop that
+	 * takes no time lets the caller poll the bus.
+	 *
+	 * @return Whether the program is still running.
+	 */
+	bool run();
+
+	/**
+	 * Abandon the program, the pump is left as it is.
+	 *
+	 * A queued command is withdrawn from the bus. One already sent is left
+	 * to finish, and the next program loaded waits for it.
+	 */
+	void cancel();
+
+	/**
+	 * Status of the program, REGLO_OK unless a command failed.
+	 */
+	int status();
+
+	/**
+	 * Offset of the instruction being executed.
+	 */
+	uint16_t position();
+
+	/**
+	 * Assemble program text to bytecode.
+	 *
+	 * A wait takes up to 65535999 ms, those over 65535 ms assembled to a
+	 * wait in seconds and one for the milliseconds left over.
+	 *
+	 * @param[in] source    Program text, see RegloProgram.
+	 * @param[out] code     Bytecode.
+	 * @param[in] size      Size of the code buffer.
+	 * @param[out] length   Number of bytes of bytecode, or on failure the
+	 *                      line of the error, counting from 1.
+	 * @return REGLO_OK, REGLO_ERROR for a bad line or REGLO_OUT_OF_RANGE
+	 *         if the code does not fit.
+	 */
+	static int assemble(const char* source, uint8_t* code, uint16_t size,
+			uint16_t* length);
+
+};
+
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @file RegloRS485.cpp
+ *
+ * Half-duplex RS-485 line with a driver enable pin.
+ */
+
+#include <Arduino.h>
+#include "RegloRS485.h"
+
+// Start, eight data and stop bit.
+const unsigned long BITS_PER_BYTE = 10;
+
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+// Line on each UART, released from its transmit complete interrupt.
+const uint8_t UARTS = 4;
+static RegloRS485* volatile lines[UARTS];
+
+// The core clears the transmit complete flag as it hands each byte to the
+// UART, so the interrupt fires once the last byte queued has been sent.
+#if defined(USART_TX_vect)
+ISR(USART_TX_vect) {
+	RegloRS485::transmitted(0);
+}
+#elif defined(USART0_TX_vect)
+ISR(USART0_TX_vect) {
+	RegloRS485::transmitted(0);
+}
+#endif
+#if defined(USART1_TX_vect)
+ISR(USART1_TX_vect) {
+	RegloRS485::transmitted(1);
+}
+#endif
+#if defined(USART2_TX_vect)
+ISR(USART2_TX_vect) {
+	RegloRS485::transmitted(2);
+}
+#endif
+#if defined(USART3_TX_vect)
+ISR(USART3_TX_vect) {
+	RegloRS485::transmitted(3);
+}
+#endif
+#endif
+
+RegloRS485::RegloRS485(Stream* stream, uint8_t pin, unsigned long baud) {
+	_stream = stream;
+	_pin = pin;
+	_driving = false;
+	_ended = false;
+	_byte_time = BITS_PER_BYTE * 1000000UL / baud;
+	_sent_at = 0;
+#if defined(__AVR__)
+	_port = NULL;
+	_mask = 0;
+#endif
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+	_control = NULL;
+	_interrupt = 0;
+#endif
+}
+
+void RegloRS485::begin() {
+#if defined(__AVR__)
+	// Writing the port directly releases the line within a cycle or two of
+	// the last stop bit, digitalWrite() takes some microseconds.
+	_port = portOutputRegister(digitalPinToPort(_pin));
+	_mask = digitalPinToBitMask(_pin);
+#endif
+	pinMode(_pin, OUTPUT);
+	drive(false);
+
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+	uint8_t uart = UARTS;
+#if defined(HAVE_HWSERIAL0) && defined(UCSR0B)
+	if (_stream == &Serial) {
+		uart = 0;
+		_control = &UCSR0B;
+		_interrupt = _BV(TXCIE0);
+	}
+#endif
+#if defined(HAVE_HWSERIAL1) && defined(UCSR1B)
+	if (_stream == &Serial1) {
+		uart = 1;
+		_control = &UCSR1B;
+		_interrupt = _BV(TXCIE1);
+	}
+#endif
+#if defined(HAVE_HWSERIAL2) && defined(UCSR2B)
+	if (_stream == &Serial2) {
+		uart = 2;
+		_control = &UCSR2B;
+		_interrupt = _BV(TXCIE2);
+	}
+#endif
+#if defined(HAVE_HWSERIAL3) && defined(UCSR3B)
+	if (_stream == &Serial3) {
+		uart = 3;
+		_control = &UCSR3B;
+		_interrupt = _BV(TXCIE3);
+	}
+#endif
+	if (uart < UARTS) {
+		lines[uart] = this;
+	}
+#endif
+}
+
+void RegloRS485::drive(bool driving) {
+	_driving = driving;
+#if defined(__AVR__)
+	if (_port != NULL) {
+		uint8_t status = SREG;
+		cli();
+		if (driving) {
+			*_port |= _mask;
+		} else {
+			*_port &= ~_mask;
+		}
+		SREG = status;
+		return;
+	}
+#endif
+	digitalWrite(_pin, driving ? HIGH : LOW);
+}
+
+void RegloRS485::poll() {
+	if (_driving && _ended && (long) (::micros() - _sent_at) >= 0) {
+		// The estimate may run ahead of a UART held up by interrupts.
+		_stream->flush();
+		drive(false);
+	}
+}
+
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+void RegloRS485::transmitted(uint8_t uart) {
+	RegloRS485* line = lines[uart];
+	if (line == NULL || line->_control == NULL) {
+		return;
+	}
+	*line->_control &= ~line->_interrupt;
+	if (line->_driving && line->_ended) {
+		line->drive(false);
+	}
+}
+#endif
+
+int RegloRS485::available() {
+	poll();
+	return _stream->available();
+}
+
+int RegloRS485::read() {
+	poll();
+	return _stream->read();
+}
+
+int RegloRS485::peek() {
+	poll();
+	return _stream->peek();
+}
+
+size_t RegloRS485::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t RegloRS485::write(const uint8_t* buffer, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+	if (!_driving) {
+		drive(true);
+	}
+
+	// The bytes follow those still being sent, or start now, with a bit
+	// to spare for the UART and the resolution of micros().
+	unsigned long now = ::micros();
+	if ((long) (_sent_at - now) < 0) {
+		_sent_at = now + _byte_time / BITS_PER_BYTE;
+	}
+	size_t written = _stream->write(buffer, size);
+	_sent_at += written * _byte_time;
+
+	// Hold the line until the end of the request has left the UART.
+	_ended = buffer[size - 1] == '\r';
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+	if (_ended && _control != NULL) {
+		// The core's data register empty interrupt also writes the control
+		// register.
+		uint8_t status = SREG;
+		cli();
+		*_control |= _interrupt;
+		SREG = status;
+	}
+#endif
+	return written;
+}
+
+void RegloRS485::flush() {
+	_stream->flush();
+	_sent_at = ::micros();
+	if (_driving) {
+		drive(false);
+	}
+}
@@ -0,0 +1,110 @@
+/**
+ * @file RegloRS485.h
+ *
+ * Half-duplex RS-485 line with a driver enable pin.
+ */
+
+#ifndef REGLO_RS485_H
+#define REGLO_RS485_H
+
+#include <Stream.h>
+#include <stdint.h>
+
+#include "RegloConfig.h"
+
+/**
+ * Stream that drives an RS-485 transceiver around each request.
+ *
+ * Pass it to RegloCPF and RegloBus in place of the serial port. The
+ * driver enable pin (usually tied to /RE) goes high before the first
+ * byte of a request and low once its last stop bit has been sent, so the
+ * line is free for the response without any fixed delay. Requests end
+ * with '\r', which is what releases the line.
+ *
+ * Writing does not wait for the UART. On AVR, with the transceiver on
+ * Serial to Serial3, the transmit complete interrupt of the UART releases
+ * the line a few cycles after the last stop bit, see
+ * REGLO_ENABLE_RS485_INTERRUPT.
+ *
+ * On any other stream the end of the request is worked out from the baud
+ * rate, and the line is released by the next poll(), which every read,
+ * peek() and available() runs, after flush() has waited for the UART. The
+ * line is then held for as long as the caller takes to poll: a pump
+ * spinning for its response releases it within microseconds, but a sketch
+ * sleeping with RegloSleepClock only on its next wake up, up to a timer
+ * tick (about 1 ms) late. A pump that answers sooner than that talks into
+ * a driven line, so on such boards keep polling or lengthen the pump's
+ * turnaround.
+ */
+class RegloRS485 : public Stream {
+
+	Stream* _stream;
+	uint8_t _pin;
+	volatile bool _driving;
+
+	// Whether the request has ended, and when its last byte will have
+	// left the UART.
+	bool _ended;
+	unsigned long _byte_time;
+	unsigned long _sent_at;
+#if defined(__AVR__)
+	volatile uint8_t* _port;
+	uint8_t _mask;
+#endif
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+	// Control register of the UART and its transmit complete interrupt
+	// enable bit, NULL if the stream is not a hardware serial port.
+	volatile uint8_t* _control;
+	uint8_t _interrupt;
+#endif
+
+	/**
+	 * Switch the transceiver to sending or receiving.
+	 */
+	void drive(bool driving);
+
+public:
+
+	/**
+	 * Construct a new RS-485 line.
+	 *
+	 * @param[in] stream    Serial port the transceiver is connected to, its
+	 *                      flush() must wait for the transmission to end,
+	 *                      as HardwareSerial does.
+	 * @param[in] pin       Driver enable pin, high while sending.
+	 * @param[in] baud      Bit rate of the serial port.
+	 */
+	RegloRS485(Stream* stream, uint8_t pin, unsigned long baud = 9600);
+
+	/**
+	 * Set up the driver enable pin, receiving. Call from setup().
+	 */
+	void begin();
+
+	/**
+	 * Release the line if the end of the request has been sent.
+	 */
+	void poll();
+
+#if defined(__AVR__) && REGLO_ENABLE_RS485_INTERRUPT
+	/**
+	 * Release the line on a UART whose transmission has ended. Called from
+	 * its transmit complete interrupt.
+	 *
+	 * @param[in] uart      Number of the UART, 0 for Serial.
+	 */
+	static void transmitted(uint8_t uart);
+#endif
+
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual size_t write(uint8_t c);
+	virtual size_t write(const uint8_t* buffer, size_t size);
+	virtual void flush();
+
+	using Print::write;
+
+};
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * @file RegloSetpoint.cpp
+ *
+ * Flow rate setpoint of a pump on a RegloBus, coalescing rapid updates.
+ */
+
+#include "RegloSetpoint.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+RegloSetpoint::RegloSetpoint(RegloBus* bus, RegloCPF* pump, uint8_t priority) :
+		_command(pump, REGLO_COMMAND_SET_FLOW_RATE, priority) {
+	_bus = bus;
+	_command.callback = delivered;
+	_command.context = this;
+	_mantisse = 0;
+	_exponent = 0;
+	_pending = false;
+	_status = REGLO_OK;
+	_echo_mantisse = 0;
+	_echo_exponent = 0;
+}
+
+int RegloSetpoint::post(int mantisse, int exponent) {
+	switch (_command.state) {
+	case REGLO_STATE_QUEUED:
+		// Not sent yet, the bus reads the rate when it dispatches.
+		_command.mantisse = mantisse;
+		_command.exponent = exponent;
+		return REGLO_OK;
+	case REGLO_STATE_SENT:
+		_mantisse = mantisse;
+		_exponent = exponent;
+		_pending = true;
+		return REGLO_OK;
+	default: {
+		_command.mantisse = mantisse;
+		_command.exponent = exponent;
+		int status = _bus->submit(&_command);
+		if (status == REGLO_OK) {
+			_pending = false;
+		}
+		return status;
+	}
+	}
+}
+
+bool RegloSetpoint::pending() {
+	return _pending || !_command.done();
+}
+
+void RegloSetpoint::poll() {
+	if (_pending && _command.done()) {
+		resend();
+	}
+}
+
+void RegloSetpoint::resend() {
+	_command.mantisse = _mantisse;
+	_command.exponent = _exponent;
+	int status = _bus->submit(&_command);
+	if (status == REGLO_OK) {
+		_pending = false;
+	} else {
+		_status = status;
+	}
+}
+
+int RegloSetpoint::status(int* mantisse, int* exponent) {
+	if (_status == REGLO_OK) {
+		if (mantisse != NULL) {
+			*mantisse = _echo_mantisse;
+		}
+		if (exponent != NULL) {
+			*exponent = _echo_exponent;
+		}
+	}
+	return _status;
+}
+
+void RegloSetpoint::delivered(RegloCommand* command) {
+	RegloSetpoint* setpoint = (RegloSetpoint*) command->context;
+	setpoint->_status = command->status;
+	if (command->status == REGLO_OK) {
+		setpoint->_echo_mantisse = command->mantisse;
+		setpoint->_echo_exponent = command->exponent;
+	}
+
+	if (!setpoint->_pending) {
+		return;
+	}
+
+	// An aborted bus refuses the rate anyway, and requeueing from a flush
+	// would only have it flushed again.
+	if (command->status == REGLO_ABORTED) {
+		setpoint->_pending = false;
+		return;
+	}
+	setpoint->resend();
+}
+
+#endif
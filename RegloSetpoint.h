@@ -0,0 +1,98 @@
+/**
+ * @file RegloSetpoint.h
+ *
+ * Flow rate setpoint of a pump on a RegloBus, coalescing rapid updates.
+ */
+
+#ifndef REGLO_SETPOINT_H
+#define REGLO_SETPOINT_H
+
+#include "RegloBus.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+/**
+ * Delivers the latest flow rate posted for a pump.
+ *
+ * A rate posted while the previous one is still queued replaces it, and
+ * one posted while the previous one is in flight is sent when that
+ * exchange ends, replacing any rate posted before it. However fast rates
+ * are posted, at most one set_flow_rate() exchange is outstanding and the
+ * newest rate goes out with the next one.
+ *
+ * Should the bus refuse to send that rate, it stays pending and status()
+ * reports the refusal, until poll() sends it or a new rate replaces it.
+ */
+class RegloSetpoint {
+
+	RegloBus* _bus;
+	RegloCommand _command;
+	int _mantisse;
+	int _exponent;
+	bool _pending;
+
+	// Outcome of the last finished exchange, apart from the command, which
+	// a new post() reuses.
+	int _status;
+	int _echo_mantisse;
+	int _echo_exponent;
+
+	/**
+	 * Record the outcome of the exchange and send the rate posted during
+	 * it, see RegloCommand::callback.
+	 */
+	static void delivered(RegloCommand* command);
+
+	/**
+	 * Submit the rate posted during the last exchange, keeping it pending
+	 * if the bus refuses it.
+	 */
+	void resend();
+
+public:
+
+	/**
+	 * Construct a setpoint for an attached pump.
+	 *
+	 * @param[in] bus       Bus the pump is attached to.
+	 * @param[in] pump      Pump to set.
+	 * @param[in] priority  Priority of the set_flow_rate() exchanges.
+	 */
+	RegloSetpoint(RegloBus* bus, RegloCPF* pump,
+			uint8_t priority = REGLO_PRIORITY_NORMAL);
+
+	/**
+	 * Post a new flow rate, replacing any not yet sent.
+	 */
+	int post(int mantisse, int exponent);
+
+	/**
+	 * Whether a posted rate has yet to be confirmed by the pump.
+	 */
+	bool pending();
+
+	/**
+	 * Send a rate the bus refused when its exchange was due. Call next to
+	 * RegloBus::poll().
+	 */
+	void poll();
+
+	/**
+	 * Get the outcome of the last finished exchange, which posting a new
+	 * rate does not change.
+	 *
+	 * @param[out] mantisse Rate last echoed by the pump on success, may be
+	 *                      NULL.
+	 * @param[out] exponent Rate last echoed by the pump on success, may be
+	 *                      NULL.
+	 * @return Status of the last finished exchange, REGLO_OK before the
+	 *         first, or the status with which the bus refused a pending
+	 *         rate.
+	 */
+	int status(int* mantisse = NULL, int* exponent = NULL);
+
+};
+
+#endif
+
+#endif
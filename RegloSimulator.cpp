@@ -0,0 +1,314 @@
+/**
+ * @file RegloSimulator.cpp
+ *
+ * Simulated line of Reglo-CPF pumps, for running without hardware.
+ */
+
+#include <string.h>
+#include "RegloSimulator.h"
+
+// Bits on the wire per byte, with start and stop bits.
+const unsigned long BITS_PER_BYTE = 10;
+
+// Default time a pump takes before responding, in microseconds.
+const unsigned long DEFAULT_TURNAROUND = 2000;
+
+/**
+ * Order two rates with four digit mantissas, returning -1, 0 or 1.
+ */
+static int compare(int mantisse_a, int exponent_a, int mantisse_b,
+		int exponent_b) {
+	if (mantisse_a != 0 && mantisse_b != 0 && exponent_a != exponent_b) {
+		return (exponent_a > exponent_b) ? 1 : -1;
+	}
+	return (mantisse_a > mantisse_b) - (mantisse_a < mantisse_b);
+}
+
+RegloSimulator::RegloSimulator(RegloClock* clock, unsigned long baud,
+		uint32_t seed) {
+	_clock = clock;
+	_byte_time = BITS_PER_BYTE * 1000000UL / baud;
+	_turnaround = DEFAULT_TURNAROUND;
+	_recovery = 0;
+	_random = (seed != 0) ? seed : 1;
+	memset(&_faults, 0, sizeof(_faults));
+	memset(&_stats, 0, sizeof(_stats));
+	memset(_pumps, 0, sizeof(_pumps));
+	_request_length = 0;
+	_answering = NULL;
+	_head = 0;
+	_count = 0;
+}
+
+void RegloSimulator::add_pump(uint8_t address) {
+	if (address < 1 || address > PUMPS) {
+		return;
+	}
+
+	Pump* pump = &_pumps[address - 1];
+	pump->present = true;
+	pump->clockwise = true;
+	pump->mantisse = 1000;
+	pump->exponent = -3;
+	pump->min_mantisse = 8000;
+	pump->min_exponent = -5;
+	pump->max_mantisse = 1800;
+	pump->max_exponent = -1;
+}
+
+void RegloSimulator::set_flow_rate_limits(uint8_t address, int min_mantisse,
+		int min_exponent, int max_mantisse, int max_exponent) {
+	if (address < 1 || address > PUMPS) {
+		return;
+	}
+
+	Pump* pump = &_pumps[address - 1];
+	pump->min_mantisse = min_mantisse;
+	pump->min_exponent = min_exponent;
+	pump->max_mantisse = max_mantisse;
+	pump->max_exponent = max_exponent;
+}
+
+void RegloSimulator::set_stuck(uint8_t address, bool stuck) {
+	if (address >= 1 && address <= PUMPS) {
+		_pumps[address - 1].stuck = stuck;
+	}
+}
+
+void RegloSimulator::set_turnaround(unsigned long micros) {
+	_turnaround = micros;
+}
+
+void RegloSimulator::set_recovery(unsigned long micros) {
+	_recovery = micros;
+}
+
+void RegloSimulator::set_faults(const RegloFaults& faults) {
+	_faults = faults;
+}
+
+const RegloSimulatorStats& RegloSimulator::stats() {
+	return _stats;
+}
+
+bool RegloSimulator::running(uint8_t address) {
+	return address >= 1 && address <= PUMPS && _pumps[address - 1].running;
+}
+
+bool RegloSimulator::clockwise(uint8_t address) {
+	return address >= 1 && address <= PUMPS && _pumps[address - 1].clockwise;
+}
+
+void RegloSimulator::get_flow_rate(uint8_t address, int* mantisse,
+		int* exponent) {
+	if (address >= 1 && address <= PUMPS) {
+		*mantisse = _pumps[address - 1].mantisse;
+		*exponent = _pumps[address - 1].exponent;
+	}
+}
+
+int RegloSimulator::available() {
+	unsigned long now = _clock->micros();
+	uint8_t ready = 0;
+	while (ready < _count
+			&& (long) (now - _due[(_head + ready) % RESPONSE_SIZE]) >= 0) {
+		ready++;
+	}
+	return ready;
+}
+
+int RegloSimulator::read() {
+	int input = peek();
+	if (input != -1) {
+		_head = (_head + 1) % RESPONSE_SIZE;
+		_count--;
+	}
+	return input;
+}
+
+int RegloSimulator::peek() {
+	if (_count == 0 || (long) (_clock->micros() - _due[_head]) < 0) {
+		return -1;
+	}
+	return _response[_head];
+}
+
+size_t RegloSimulator::write(uint8_t c) {
+	if (_request_length < REQUEST_SIZE - 1) {
+		_request[_request_length++] = c;
+	}
+	if (c == '\r') {
+		_request[_request_length] = '\0';
+		process();
+		_request_length = 0;
+	}
+	return 1;
+}
+
+void RegloSimulator::flush() {
+}
+
+void RegloSimulator::process() {
+	_stats.requests++;
+
+	// Requests are "<address><command>[<mantissa><sign><exponent>]\r".
+	const char* c = _request;
+	uint8_t address = 0;
+	while (*c >= '0' && *c <= '9') {
+		address = address * 10 + (*c++ - '0');
+	}
+	if (address < 1 || address > PUMPS || !_pumps[address - 1].present
+			|| _pumps[address - 1].stuck) {
+		return;
+	}
+
+	Pump* pump = &_pumps[address - 1];
+	unsigned long arrival = _clock->micros() + _request_length * _byte_time;
+	if (_recovery > 0 && (long) (arrival - pump->ready) < 0) {
+		_stats.refused++;
+		_answering = NULL;
+		respond("#");
+		return;
+	}
+	_answering = pump;
+
+	char command = *c++;
+	switch (command) {
+	case 'H':
+		pump->running = true;
+		break;
+	case 'I':
+		pump->running = false;
+		break;
+	case 'J':
+		pump->clockwise = true;
+		break;
+	case 'K':
+		pump->clockwise = false;
+		break;
+	case 'A':
+	case 'B':
+		break;
+	case 'f': {
+			if (*c != '\r') {
+				int mantisse = 0;
+				for (uint8_t i = 0; i < 4; i++, c++) {
+					if (*c < '0' || *c > '9') {
+						respond("#");
+						return;
+					}
+					mantisse = mantisse * 10 + (*c - '0');
+				}
+				char sign = *c++;
+				if ((sign != '+' && sign != '-') || *c < '0' || *c > '9') {
+					respond("#");
+					return;
+				}
+				int exponent = (sign == '-') ? -(*c - '0') : (*c - '0');
+
+				// Clamp to the limits of the pump, like the hardware does.
+				if (compare(mantisse, exponent, pump->min_mantisse,
+						pump->min_exponent) < 0) {
+					mantisse = pump->min_mantisse;
+					exponent = pump->min_exponent;
+					_stats.clamped++;
+				} else if (compare(mantisse, exponent, pump->max_mantisse,
+						pump->max_exponent) > 0) {
+					mantisse = pump->max_mantisse;
+					exponent = pump->max_exponent;
+					_stats.clamped++;
+				}
+				pump->mantisse = mantisse;
+				pump->exponent = exponent;
+			}
+
+			char response[12];
+			int exponent = pump->exponent;
+			response[0] = '0' + pump->mantisse / 1000 % 10;
+			response[1] = '0' + pump->mantisse / 100 % 10;
+			response[2] = '0' + pump->mantisse / 10 % 10;
+			response[3] = '0' + pump->mantisse % 10;
+			response[4] = 'E';
+			response[5] = (exponent < 0) ? '-' : '+';
+			response[6] = '0' + ((exponent < 0) ? -exponent : exponent);
+			response[7] = '\r';
+			response[8] = '\n';
+			response[9] = '\0';
+			respond(response);
+			return;
+	}
+	default:
+		respond("#");
+		return;
+	}
+	respond("*");
+}
+
+void RegloSimulator::respond(const char* response) {
+	if (chance(_faults.error)) {
+		response = "#";
+		_stats.errors++;
+	}
+
+	// The response follows the request over the wire, and any response
+	// still being sent.
+	unsigned long due = _clock->micros() + _request_length * _byte_time
+			+ _turnaround;
+	if (_count > 0) {
+		unsigned long last = _due[(_head + _count - 1) % RESPONSE_SIZE];
+		if ((long) (last + _byte_time - due) > 0) {
+			due = last + _byte_time;
+		}
+	}
+	if (chance(_faults.delay)) {
+		due += _faults.delay_time;
+		_stats.delayed++;
+	}
+
+	uint8_t copies = 1;
+	if (chance(_faults.duplicate)) {
+		copies = 2;
+		_stats.duplicated++;
+	}
+
+	while (copies-- > 0) {
+		_stats.responses++;
+		for (const char* c = response; *c != '\0'; c++) {
+			if (chance(_faults.loss)) {
+				_stats.lost++;
+				continue;
+			}
+
+			uint8_t output = *c;
+			if (chance(_faults.corruption)) {
+				output ^= 1 << (_random % 8);
+				_stats.corrupted++;
+			}
+
+			if (_count == RESPONSE_SIZE) {
+				_stats.overflows++;
+				continue;
+			}
+			uint8_t tail = (_head + _count++) % RESPONSE_SIZE;
+			_response[tail] = output;
+			_due[tail] = due;
+			due += _byte_time;
+		}
+	}
+
+	if (_answering != NULL) {
+		_answering->ready = due + _recovery;
+	}
+}
+
+bool RegloSimulator::chance(uint32_t parts_per_million) {
+	if (parts_per_million == 0) {
+		return false;
+	}
+
+	// Xorshift, deterministic for a given seed.
+	_random ^= _random << 13;
+	_random ^= _random >> 17;
+	_random ^= _random << 5;
+	return _random % 1000000UL < parts_per_million;
+}
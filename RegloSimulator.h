@@ -0,0 +1,188 @@
+/**
+ * @file RegloSimulator.h
+ *
+ * Simulated line of Reglo-CPF pumps, for running without hardware.
+ */
+
+#ifndef REGLO_SIMULATOR_H
+#define REGLO_SIMULATOR_H
+
+#include <Stream.h>
+#include <stdint.h>
+
+#include "RegloClock.h"
+
+/**
+ * Faults injected by a RegloSimulator.
+ *
+ * Chances are given in parts per million.
+ */
+struct RegloFaults {
+
+	uint32_t loss;              //!< Chance of losing a response byte.
+	uint32_t corruption;        //!< Chance of flipping a bit in a byte.
+	uint32_t error;             //!< Chance of answering '#'.
+	uint32_t delay;             //!< Chance of a late response.
+	uint32_t duplicate;         //!< Chance of sending a response twice.
+	unsigned long delay_time;   //!< Extra microseconds of a late response.
+
+};
+
+/**
+ * Counters kept by a RegloSimulator.
+ */
+struct RegloSimulatorStats {
+
+	unsigned long requests;     //!< Complete requests received.
+	unsigned long responses;    //!< Responses sent, including faulty ones.
+	unsigned long lost;         //!< Response bytes lost.
+	unsigned long corrupted;    //!< Response bytes corrupted.
+	unsigned long errors;       //!< '#' responses injected.
+	unsigned long delayed;      //!< Responses delayed.
+	unsigned long duplicated;   //!< Responses sent twice.
+	unsigned long clamped;      //!< Flow rates clamped to a limit.
+	unsigned long overflows;    //!< Response bytes dropped for lack of room.
+	unsigned long refused;      //!< Requests refused while recovering.
+
+};
+
+/**
+ * Stream that behaves like a line of Reglo-CPF pumps.
+ *
+ * Requests written to the stream are answered by the simulated pump at
+ * their address, with responses becoming readable at the time they would
+ * arrive over the wire according to the clock. Faults are drawn from a
+ * seeded generator, so a run is repeatable.
+ */
+class RegloSimulator : public Stream {
+
+	// Simulated pump state, indexed by address - 1.
+	struct Pump {
+		bool present;
+		bool stuck;
+		bool running;
+		bool clockwise;
+		int mantisse;
+		int exponent;
+		int min_mantisse;
+		int min_exponent;
+		int max_mantisse;
+		int max_exponent;
+		unsigned long ready;    // Clock time it recovers from its response.
+	};
+
+	static const uint8_t PUMPS = 8;
+	static const uint8_t REQUEST_SIZE = 16;
+	static const uint8_t RESPONSE_SIZE = 64;
+
+	RegloClock* _clock;
+	unsigned long _byte_time;
+	unsigned long _turnaround;
+	unsigned long _recovery;
+	uint32_t _random;
+	RegloFaults _faults;
+	RegloSimulatorStats _stats;
+	Pump _pumps[PUMPS];
+
+	char _request[REQUEST_SIZE];
+	uint8_t _request_length;
+	Pump* _answering;
+
+	// Queued response bytes and the time each becomes readable.
+	uint8_t _response[RESPONSE_SIZE];
+	unsigned long _due[RESPONSE_SIZE];
+	uint8_t _head;
+	uint8_t _count;
+
+	/**
+	 * Answer a complete request.
+	 */
+	void process();
+
+	/**
+	 * Queue a response, applying faults.
+	 */
+	void respond(const char* response);
+
+	/**
+	 * Draw from the fault generator, true with the given chance.
+	 */
+	bool chance(uint32_t parts_per_million);
+
+public:
+
+	/**
+	 * Construct a new simulated line without pumps.
+	 *
+	 * @param[in] clock     Time source, typically a RegloVirtualClock that
+	 *                      is shared with the pumps.
+	 * @param[in] baud      Line speed, used for the time bytes take.
+	 * @param[in] seed      Seed of the fault generator.
+	 */
+	RegloSimulator(RegloClock* clock, unsigned long baud = 9600,
+			uint32_t seed = 1);
+
+	/**
+	 * Put a pump on the line, stopped, clockwise, at 1 ml/min and accepting
+	 * rates from 0.08 to 180 ml/min.
+	 */
+	void add_pump(uint8_t address);
+
+	/**
+	 * Set the rates a pump clamps requested rates to.
+	 */
+	void set_flow_rate_limits(uint8_t address, int min_mantisse,
+			int min_exponent, int max_mantisse, int max_exponent);
+
+	/**
+	 * Make a pump stop responding, or respond again.
+	 */
+	void set_stuck(uint8_t address, bool stuck);
+
+	/**
+	 * Set the time a pump takes before it starts responding.
+	 */
+	void set_turnaround(unsigned long micros);
+
+	/**
+	 * Set the time a pump needs after its response before it accepts the
+	 * next request, which it refuses with '#' until then. None by default.
+	 */
+	void set_recovery(unsigned long micros);
+
+	/**
+	 * Set the faults to inject from now on.
+	 */
+	void set_faults(const RegloFaults& faults);
+
+	/**
+	 * Get the counters of the simulator.
+	 */
+	const RegloSimulatorStats& stats();
+
+	/**
+	 * Whether a simulated pump is running.
+	 */
+	bool running(uint8_t address);
+
+	/**
+	 * Whether a simulated pump turns clockwise.
+	 */
+	bool clockwise(uint8_t address);
+
+	/**
+	 * Get the flow rate of a simulated pump.
+	 */
+	void get_flow_rate(uint8_t address, int* mantisse, int* exponent);
+
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual size_t write(uint8_t c);
+	virtual void flush();
+
+	using Print::write;
+
+};
+
+#endif
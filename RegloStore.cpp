@@ -0,0 +1,285 @@
+/**
+ * @file RegloStore.cpp
+ *
+ * Configuration of the pumps on a RegloBus, kept across restarts.
+ */
+
+#if defined(__AVR__)
+#include <avr/eeprom.h>
+#endif
+#include "RegloStore.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+// Layout of the record, words little endian.
+enum {
+	OFFSET_MAGIC,
+	OFFSET_VERSION,
+	OFFSET_PRESENT,
+	OFFSET_PUMPS
+};
+
+// Layout of each pump within the record.
+enum {
+	PUMP_FLAGS,
+	PUMP_GAP,
+	PUMP_MIN_MANTISSE,
+	PUMP_MIN_EXPONENT = PUMP_MIN_MANTISSE + 2,
+	PUMP_MAX_MANTISSE,
+	PUMP_MAX_EXPONENT = PUMP_MAX_MANTISSE + 2,
+	PUMP_MANTISSE,
+	PUMP_EXPONENT = PUMP_MANTISSE + 2,
+	PUMP_SIZE
+};
+
+// What is known of a pump.
+enum {
+	FLAG_LIMITS = 1 << 0,
+	FLAG_CLAMP = 1 << 1,
+	FLAG_SETPOINT = 1 << 2
+};
+
+// Microseconds per step of a stored pause, those of RegloBus::gap().
+const unsigned long GAP_UNIT = 100;
+
+const uint8_t MAGIC = 'R';
+const uint8_t OFFSET_CHECKSUM = OFFSET_PUMPS + PUMP_SIZE * REGLO_MAX_PUMPS;
+
+static_assert(OFFSET_CHECKSUM + 2 == REGLO_STORE_SIZE,
+		"REGLO_STORE_SIZE does not match the record layout");
+
+/**
+ * Offset of a field of the pump at an address.
+ */
+static uint8_t field(uint8_t address, uint8_t offset) {
+	return OFFSET_PUMPS + (address - 1) * PUMP_SIZE + offset;
+}
+
+RegloStore::RegloStore(uint8_t* storage) {
+	_storage = storage;
+}
+
+uint8_t RegloStore::read(uint8_t offset) {
+#if defined(__AVR__)
+	return eeprom_read_byte(_storage + offset);
+#else
+	return _storage[offset];
+#endif
+}
+
+void RegloStore::write(uint8_t offset, uint8_t value) {
+#if defined(__AVR__)
+	eeprom_update_byte(_storage + offset, value);
+#else
+	_storage[offset] = value;
+#endif
+}
+
+uint16_t RegloStore::read_word(uint8_t offset) {
+	return read(offset) | (uint16_t) read(offset + 1) << 8;
+}
+
+void RegloStore::write_word(uint8_t offset, uint16_t value) {
+	write(offset, value & 0xFF);
+	write(offset + 1, value >> 8);
+}
+
+uint16_t RegloStore::checksum() {
+	// CRC-16/CCITT, bit by bit to stay small.
+	uint16_t crc = 0xFFFF;
+	for (uint8_t offset = 0; offset < OFFSET_CHECKSUM; offset++) {
+		crc ^= (uint16_t) read(offset) << 8;
+		for (uint8_t bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+void RegloStore::seal() {
+	write_word(OFFSET_CHECKSUM, checksum());
+}
+
+bool RegloStore::valid() {
+	return read(OFFSET_MAGIC) == MAGIC
+			&& read(OFFSET_VERSION) == REGLO_STORE_VERSION
+			&& read_word(OFFSET_CHECKSUM) == checksum();
+}
+
+void RegloStore::erase() {
+	write(OFFSET_MAGIC, 0);
+}
+
+int RegloStore::save(RegloBus* bus) {
+	int error = REGLO_OK;
+	uint8_t present = 0;
+
+	for (uint8_t address = 1; address <= REGLO_MAX_PUMPS; address++) {
+		RegloCPF* pump = bus->pump(address);
+		uint8_t flags = 0;
+		int min_mantisse = 0;
+		int min_exponent = 0;
+		int max_mantisse = 0;
+		int max_exponent = 0;
+		int mantisse = 0;
+		int exponent = 0;
+
+		if (pump != NULL) {
+			present |= 1 << (address - 1);
+			if (pump->get_flow_rate_limits(&min_mantisse, &min_exponent,
+					&max_mantisse, &max_exponent) == REGLO_OK) {
+				flags |= FLAG_LIMITS;
+			}
+			if (pump->limit_policy() == REGLO_LIMIT_CLAMP) {
+				flags |= FLAG_CLAMP;
+			}
+			int status = pump->get_flow_rate(&mantisse, &exponent);
+			if (status == REGLO_OK) {
+				flags |= FLAG_SETPOINT;
+			} else if (error == REGLO_OK) {
+				error = status;
+			}
+		}
+
+		write(field(address, PUMP_FLAGS), flags);
+		write(field(address, PUMP_GAP), bus->gap(address) / GAP_UNIT);
+		write_word(field(address, PUMP_MIN_MANTISSE), min_mantisse);
+		write(field(address, PUMP_MIN_EXPONENT), min_exponent);
+		write_word(field(address, PUMP_MAX_MANTISSE), max_mantisse);
+		write(field(address, PUMP_MAX_EXPONENT), max_exponent);
+		write_word(field(address, PUMP_MANTISSE), mantisse);
+		write(field(address, PUMP_EXPONENT), exponent);
+	}
+
+	write(OFFSET_MAGIC, MAGIC);
+	write(OFFSET_VERSION, REGLO_STORE_VERSION);
+	write(OFFSET_PRESENT, present);
+	seal();
+	return error;
+}
+
+int RegloStore::save_setpoint(uint8_t address, int mantisse, int exponent) {
+	if (address < 1 || address > REGLO_MAX_PUMPS || !valid()
+			|| !(read(OFFSET_PRESENT) & 1 << (address - 1))) {
+		return REGLO_ERROR;
+	}
+	if (RegloCPF::normalize_flow_rate(&mantisse, &exponent) != REGLO_OK) {
+		return REGLO_OUT_OF_RANGE;
+	}
+
+	// Spare the EEPROM a rewrite of the checksum for the same setpoint.
+	int recorded_mantisse;
+	int recorded_exponent;
+	if (setpoint(address, &recorded_mantisse, &recorded_exponent) == REGLO_OK
+			&& recorded_mantisse == mantisse
+			&& recorded_exponent == exponent) {
+		return REGLO_OK;
+	}
+
+	write_word(field(address, PUMP_MANTISSE), mantisse);
+	write(field(address, PUMP_EXPONENT), exponent);
+	write(field(address, PUMP_FLAGS),
+			read(field(address, PUMP_FLAGS)) | FLAG_SETPOINT);
+	seal();
+	return REGLO_OK;
+}
+
+int RegloStore::restore(RegloBus* bus, uint8_t* present) {
+	if (present != NULL) {
+		*present = 0;
+	}
+	if (!valid()) {
+		return REGLO_ERROR;
+	}
+
+	uint8_t recorded = read(OFFSET_PRESENT);
+	for (uint8_t address = 1; address <= REGLO_MAX_PUMPS; address++) {
+		RegloCPF* pump = bus->pump(address);
+		if (pump == NULL || !(recorded & 1 << (address - 1))) {
+			continue;
+		}
+
+		uint8_t flags = read(field(address, PUMP_FLAGS));
+		if (flags & FLAG_LIMITS) {
+			pump->set_flow_rate_limits(
+					(int16_t) read_word(field(address, PUMP_MIN_MANTISSE)),
+					(int8_t) read(field(address, PUMP_MIN_EXPONENT)),
+					(int16_t) read_word(field(address, PUMP_MAX_MANTISSE)),
+					(int8_t) read(field(address, PUMP_MAX_EXPONENT)));
+		}
+		pump->set_limit_policy((flags & FLAG_CLAMP) ? REGLO_LIMIT_CLAMP
+				: REGLO_LIMIT_REJECT);
+		bus->set_gap(address, read(field(address, PUMP_GAP)) * GAP_UNIT);
+	}
+
+	if (present != NULL) {
+		*present = recorded;
+	}
+	return REGLO_OK;
+}
+
+int RegloStore::verify(RegloBus* bus, uint8_t* confirmed) {
+	if (confirmed != NULL) {
+		*confirmed = 0;
+	}
+	if (!valid()) {
+		return REGLO_ERROR;
+	}
+
+	uint8_t recorded = read(OFFSET_PRESENT);
+	uint8_t verified = 0;
+	for (uint8_t address = 1; address <= REGLO_MAX_PUMPS; address++) {
+		RegloCPF* pump = bus->pump(address);
+		if (pump == NULL || !(recorded & 1 << (address - 1))) {
+			continue;
+		}
+
+		int mantisse;
+		int exponent;
+		if (pump->get_flow_rate(&mantisse, &exponent) != REGLO_OK) {
+			continue;
+		}
+
+		// A pump recorded without a setpoint is confirmed by answering.
+		if (!(read(field(address, PUMP_FLAGS)) & FLAG_SETPOINT)) {
+			verified |= 1 << (address - 1);
+			continue;
+		}
+
+		int expected_mantisse;
+		int expected_exponent;
+		if (setpoint(address, &expected_mantisse, &expected_exponent)
+				!= REGLO_OK
+				|| RegloCPF::normalize_flow_rate(&mantisse, &exponent)
+						!= REGLO_OK) {
+			continue;
+		}
+		if (mantisse == expected_mantisse && exponent == expected_exponent) {
+			verified |= 1 << (address - 1);
+		}
+	}
+
+	if (confirmed != NULL) {
+		*confirmed = verified;
+	}
+	return (verified == recorded) ? REGLO_OK : REGLO_ERROR;
+}
+
+int RegloStore::setpoint(uint8_t address, int* mantisse, int* exponent) {
+	if (address < 1 || address > REGLO_MAX_PUMPS || !valid()
+			|| !(read(field(address, PUMP_FLAGS)) & FLAG_SETPOINT)) {
+		return REGLO_ERROR;
+	}
+
+	int recorded_mantisse = (int16_t) read_word(field(address, PUMP_MANTISSE));
+	int recorded_exponent = (int8_t) read(field(address, PUMP_EXPONENT));
+	if (RegloCPF::normalize_flow_rate(&recorded_mantisse, &recorded_exponent)
+			!= REGLO_OK) {
+		return REGLO_ERROR;
+	}
+	*mantisse = recorded_mantisse;
+	*exponent = recorded_exponent;
+	return REGLO_OK;
+}
+
+#endif
@@ -0,0 +1,153 @@
+/**
+ * @file RegloStore.h
+ *
+ * Configuration of the pumps on a RegloBus, kept across restarts.
+ */
+
+#ifndef REGLO_STORE_H
+#define REGLO_STORE_H
+
+#include "RegloBus.h"
+
+#if REGLO_ENABLE_FLOW_RATE
+
+/**
+ * Version of the stored record, records of another version are ignored.
+ */
+const uint8_t REGLO_STORE_VERSION = 1;
+
+/**
+ * Bytes of storage taken by a record.
+ */
+const uint8_t REGLO_STORE_SIZE = 3 + 11 * REGLO_MAX_PUMPS + 2;
+
+/**
+ * Keeps what was learned about the pumps on a bus in EEPROM, so a restart
+ * can skip rediscovering it over the line.
+ *
+ * The record holds the addresses present, and for each pump its flow rate
+ * limits and limit policy, its pause on the bus and its last setpoint,
+ * closed by a CRC. On boot, restore() hands the limits and pauses back to
+ * the attached pumps without any traffic, and verify() confirms with one
+ * query per pump that the pumps still run at their setpoints. Only if that
+ * fails is a full RegloBus::scan() and probe_flow_rate_limits() needed:
+ *
+ *     uint8_t present;
+ *     if (store.restore(&bus, &present) != REGLO_OK
+ *             || store.verify(&bus, NULL) != REGLO_OK) {
+ *         // Discover the pumps, then store.save(&bus).
+ *     }
+ *
+ * Storage is an EEPROM address on AVR, where bytes are only written when
+ * they change, and REGLO_STORE_SIZE bytes of RAM elsewhere, for the caller
+ * to persist.
+ */
+class RegloStore {
+
+	uint8_t* _storage;
+
+	/**
+	 * Read a byte of the record.
+	 */
+	uint8_t read(uint8_t offset);
+
+	/**
+	 * Write a byte of the record.
+	 */
+	void write(uint8_t offset, uint8_t value);
+
+	/**
+	 * Write a little endian word of the record.
+	 */
+	void write_word(uint8_t offset, uint16_t value);
+
+	/**
+	 * Read a little endian word of the record.
+	 */
+	uint16_t read_word(uint8_t offset);
+
+	/**
+	 * CRC of the record up to its checksum.
+	 */
+	uint16_t checksum();
+
+	/**
+	 * Close the record with its checksum.
+	 */
+	void seal();
+
+public:
+
+	/**
+	 * Construct a store at a place in EEPROM on AVR, or in RAM elsewhere.
+	 */
+	RegloStore(uint8_t* storage);
+
+	/**
+	 * Record the attached pumps.
+	 *
+	 * Asks each pump for its flow rate, with a blocking call, as its
+	 * setpoint, so the bus must be idle.
+	 *
+	 * @return REGLO_OK, or the status of the first pump that did not answer,
+	 *         which is recorded without a setpoint.
+	 */
+	int save(RegloBus* bus);
+
+	/**
+	 * Record the last setpoint of one pump, without any traffic. Nothing is
+	 * written if the setpoint is already recorded.
+	 *
+	 * Each change rewrites the setpoint and the checksum, and EEPROM cells
+	 * last about 100,000 writes, so rate limit the calls, e.g. on a timer
+	 * once a new rate has held for a while, or at shutdown, rather than
+	 * after every change.
+	 *
+	 * @return REGLO_ERROR if there is no valid record of the pump.
+	 */
+	int save_setpoint(uint8_t address, int mantisse, int exponent);
+
+	/**
+	 * Hand the recorded limits, limit policies and pauses to the attached
+	 * pumps, without any traffic.
+	 *
+	 * @param[out] present  Bit (address - 1) for each pump recorded, may
+	 *                      be NULL.
+	 * @return REGLO_ERROR if there is no valid record.
+	 */
+	int restore(RegloBus* bus, uint8_t* present);
+
+	/**
+	 * Confirm that the recorded pumps are attached and run at their
+	 * setpoints, with one blocking flow rate query each. A pump recorded
+	 * without a setpoint is confirmed by answering the query.
+	 *
+	 * @param[out] confirmed    Bit (address - 1) for each pump confirmed,
+	 *                          may be NULL.
+	 * @return REGLO_OK if every recorded pump was confirmed, REGLO_ERROR
+	 *         if there is no valid record or a pump differs.
+	 */
+	int verify(RegloBus* bus, uint8_t* confirmed);
+
+	/**
+	 * Get the last setpoint recorded for a pump.
+	 *
+	 * @return REGLO_ERROR if none is recorded.
+	 */
+	int setpoint(uint8_t address, int* mantisse, int* exponent);
+
+	/**
+	 * Whether the storage holds a valid record.
+	 */
+	bool valid();
+
+	/**
+	 * Invalidate the record, e.g. after replacing pumps.
+	 */
+	void erase();
+
+};
+
+#endif
+
+#endif
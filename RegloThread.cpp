@@ -0,0 +1,17 @@
+/**
+ * @file RegloThread.cpp
+ *
+ * Cooperative tasks for sketches, in the style of protothreads.
+ */
+
+#include "RegloThread.h"
+
+RegloThread::RegloThread(RegloClock* clock) {
+	line = 0;
+	since = 0;
+	this->clock = clock;
+}
+
+void RegloThread::restart() {
+	line = 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file RegloThread.h
+ *
+ * Cooperative tasks for sketches, in the style of protothreads.
+ */
+
+#ifndef REGLO_THREAD_H
+#define REGLO_THREAD_H
+
+#include "RegloBus.h"
+
+/**
+ * State of a cooperative task.
+ *
+ * A task is a function taking its RegloThread and returning whether it is
+ * still running. Between REGLO_TASK_BEGIN and REGLO_TASK_END it may wait
+ * for a time, a condition or a pump command, returning to the caller
+ * meanwhile, and continues where it left off the next time it is called:
+ *
+ *     bool flush(RegloThread* thread) {
+ *         REGLO_TASK_BEGIN(thread);
+ *         REGLO_TASK_COMMAND(thread, &bus, &pump, REGLO_COMMAND_START);
+ *         REGLO_TASK_SLEEP(thread, 5000);
+ *         REGLO_TASK_COMMAND(thread, &bus, &pump, REGLO_COMMAND_STOP);
+ *         REGLO_TASK_END(thread);
+ *     }
+ *
+ * Call every task from loop(), next to RegloBus::poll(). Local variables
+ * do not survive a wait, keep such state in a struct derived from
+ * RegloThread. Waits are told apart by their line, so there can be only
+ * one per line, and a task must not use switch statements around them.
+ */
+struct RegloThread {
+
+	uint16_t line;              //!< Where to continue, 0 at the start.
+	unsigned long since;        //!< Clock time the current sleep started.
+	RegloClock* clock;          //!< Time source for sleeps.
+	RegloCommand command;       //!< Last command, with its status.
+
+	/**
+	 * Construct a task state at the start, sleeping on the board's clock.
+	 */
+	RegloThread(RegloClock* clock = &RegloSystemClock);
+
+	/**
+	 * Start the task over on its next call.
+	 */
+	void restart();
+
+};
+
+// Marks the deliberate fall through into the case label of a wait.
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define REGLO_TASK_FALLTHROUGH __attribute__((fallthrough))
+#else
+#define REGLO_TASK_FALLTHROUGH
+#endif
+
+/**
+ * Open the body of a task.
+ */
+#define REGLO_TASK_BEGIN(thread) \
+	switch ((thread)->line) { \
+	case 0:
+
+/**
+ * Close the body of a task, which then reports that it has finished and
+ * starts over if it is called again.
+ */
+#define REGLO_TASK_END(thread) \
+	} \
+	(thread)->line = 0; \
+	return false
+
+/**
+ * Return to the caller until a condition holds.
+ */
+#define REGLO_TASK_WAIT_UNTIL(thread, condition) \
+	do { \
+		(thread)->line = __LINE__; \
+		REGLO_TASK_FALLTHROUGH; \
+	case __LINE__: \
+		if (!(condition)) { \
+			return true; \
+		} \
+	} while (0)
+
+/**
+ * Return to the caller once, letting other tasks run.
+ */
+#define REGLO_TASK_YIELD(thread) \
+	do { \
+		(thread)->line = __LINE__; \
+		return true; \
+	case __LINE__:; \
+	} while (0)
+
+/**
+ * Return to the caller until some milliseconds have passed.
+ */
+#define REGLO_TASK_SLEEP(thread, milliseconds) \
+	do { \
+		(thread)->since = (thread)->clock->millis(); \
+		REGLO_TASK_WAIT_UNTIL(thread, (thread)->clock->millis() \
+				- (thread)->since >= (unsigned long) (milliseconds)); \
+	} while (0)
+
+/**
+ * Queue a command and return to the caller until it has finished, its
+ * status is left in thread->command.status. A flow rate to set is taken
+ * from thread->command.mantisse and exponent, where a rate received is
+ * also left.
+ */
+#define REGLO_TASK_COMMAND(thread, bus, pump_, command_) \
+	do { \
+		(thread)->command.pump = (pump_); \
+		(thread)->command.command = (command_); \
+		{ \
+			int status_ = (bus)->submit(&(thread)->command); \
+			if (status_ != REGLO_OK) { \
+				(thread)->command.status = status_; \
+				break; \
+			} \
+		} \
+		REGLO_TASK_WAIT_UNTIL(thread, (thread)->command.done()); \
+	} while (0)
+
+#endif
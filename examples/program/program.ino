@@ -0,0 +1,134 @@
+/**
+ * @file program.ino
+ *
+ * Assemble two pump programs and run them side by side on simulated pumps,
+ * printing each change of pump state.
+ *
+ * The pumps are simulated on a virtual clock, so this runs without any
+ * hardware and much faster than real time. Replace the simulator with the
+ * serial port to run the same programs on real pumps.
+ */
+
+#include <RegloProgram.h>
+#include <RegloSimulator.h>
+
+// Prime the line, then dose 0.5 ml three times a minute apart.
+const char DOSE[] =
+    "rate 2000 -3        # 2 ml/min\n"
+    "clockwise\n"
+    "start\n"
+    "wait 3000\n"
+    "stop\n"
+    "loop 3\n"
+    "  dispense 5000 -4  # 0.5 ml\n"
+    "  wait 60000\n"
+    "next\n";
+
+// Stir back and forth for ever.
+const char STIR[] =
+    "rate 1000 -2        # 10 ml/min\n"
+    "loop 0\n"
+    "  clockwise\n"
+    "  start\n"
+    "  wait 20000\n"
+    "  counterclockwise\n"
+    "  wait 20000\n"
+    "  stop\n"
+    "  wait 10000\n"
+    "next\n";
+
+// Simulated microseconds per pass through loop().
+const unsigned long STEP = 100;
+
+// Simulated time to run for.
+const unsigned long DURATION = 240000;
+
+RegloVirtualClock simulated_clock;
+RegloSimulator line(&simulated_clock);
+RegloBus bus(&line);
+
+RegloCPF pumps[] = {
+    RegloCPF(&line, 1),
+    RegloCPF(&line, 2)
+};
+
+RegloProgram programs[] = {
+    RegloProgram(&bus, &pumps[0]),
+    RegloProgram(&bus, &pumps[1])
+};
+
+uint8_t code[2][32];
+
+// Last state printed for each pump, simulated pumps start stopped and
+// clockwise.
+bool running[2];
+bool clockwise[2] = { true, true };
+
+/**
+ * Assemble a program and load it, reporting any error.
+ */
+void prepare(uint8_t index, const char* source)
+{
+    uint16_t length;
+    if (RegloProgram::assemble(source, code[index], sizeof(code[index]), &length)
+            != REGLO_OK) {
+        Serial.print("pump ");
+        Serial.print(index + 1);
+        Serial.print(": error on line ");
+        Serial.println(length);
+        return;
+    }
+    programs[index].load(code[index], length);
+
+    Serial.print("pump ");
+    Serial.print(index + 1);
+    Serial.print(": ");
+    Serial.print(length);
+    Serial.println(" bytes");
+}
+
+void setup()
+{
+    Serial.begin(9600);
+
+    bus.set_clock(&simulated_clock);
+    for (uint8_t i = 0; i < 2; i++) {
+        line.add_pump(i + 1);
+        bus.attach(&pumps[i]);
+    }
+
+    prepare(0, DOSE);
+    prepare(1, STIR);
+}
+
+void loop()
+{
+    if (simulated_clock.millis() >= DURATION) {
+        return;
+    }
+
+    simulated_clock.advance(STEP);
+    bus.poll();
+
+    for (uint8_t i = 0; i < 2; i++) {
+        if (!programs[i].run() && programs[i].status() != REGLO_OK) {
+            Serial.print("pump ");
+            Serial.print(i + 1);
+            Serial.print(": failed with ");
+            Serial.println(programs[i].status());
+            programs[i].cancel();
+        }
+
+        bool now_running = line.running(i + 1);
+        bool now_clockwise = line.clockwise(i + 1);
+        if (now_running != running[i] || now_clockwise != clockwise[i]) {
+            running[i] = now_running;
+            clockwise[i] = now_clockwise;
+            Serial.print(simulated_clock.millis());
+            Serial.print(" ms: pump ");
+            Serial.print(i + 1);
+            Serial.print(now_running ? " running " : " stopped ");
+            Serial.println(now_clockwise ? "clockwise" : "counter-clockwise");
+        }
+    }
+}
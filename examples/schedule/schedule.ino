@@ -0,0 +1,118 @@
+/**
+ * @file schedule.ino
+ *
+ * Run three pumps on the serial port to overlapping schedules, without
+ * blocking.
+ *
+ * Each pump is driven by its own cooperative task, so one pump waiting
+ * for its next step never holds up the others or the loop.
+ */
+
+#include <RegloBus.h>
+#include <RegloThread.h>
+
+RegloBus bus(&Serial);
+
+RegloCPF pumps[] = {
+    RegloCPF(&Serial, 1),
+    RegloCPF(&Serial, 2),
+    RegloCPF(&Serial, 3)
+};
+
+// Digital LED pin, lit when a command fails.
+const uint8_t PIN_LED = 13;
+
+/**
+ * Task state of a pump that runs for a while, every so often.
+ */
+struct Cycle : RegloThread {
+    RegloCPF* pump;
+    unsigned long on;
+    unsigned long off;
+};
+
+/**
+ * Task state of a pump that alternates between two flow rates.
+ */
+struct Alternate : RegloThread {
+    RegloCPF* pump;
+    bool fast;
+};
+
+Cycle flush;
+Cycle circulate;
+Alternate dose;
+
+/**
+ * Light the LED if the last command of a task failed.
+ */
+void check(RegloThread* thread)
+{
+    if (thread->command.status != REGLO_OK) {
+        digitalWrite(PIN_LED, HIGH);
+    }
+}
+
+/**
+ * Start a pump, let it run, stop it and pause, over and over.
+ */
+bool cycle(Cycle* task)
+{
+    REGLO_TASK_BEGIN(task);
+    for (;;) {
+        REGLO_TASK_COMMAND(task, &bus, task->pump, REGLO_COMMAND_START);
+        check(task);
+        REGLO_TASK_SLEEP(task, task->on);
+        REGLO_TASK_COMMAND(task, &bus, task->pump, REGLO_COMMAND_STOP);
+        check(task);
+        REGLO_TASK_SLEEP(task, task->off);
+    }
+    REGLO_TASK_END(task);
+}
+
+/**
+ * Keep a pump running, switching between 2 and 8 ml/min every 7 seconds.
+ */
+bool alternate(Alternate* task)
+{
+    REGLO_TASK_BEGIN(task);
+    REGLO_TASK_COMMAND(task, &bus, task->pump, REGLO_COMMAND_START);
+    check(task);
+    for (;;) {
+        task->fast = !task->fast;
+        task->command.mantisse = task->fast ? 8000 : 2000;
+        task->command.exponent = -3;
+        REGLO_TASK_COMMAND(task, &bus, task->pump, REGLO_COMMAND_SET_FLOW_RATE);
+        check(task);
+        REGLO_TASK_SLEEP(task, 7000);
+    }
+    REGLO_TASK_END(task);
+}
+
+void setup()
+{
+    pinMode(PIN_LED, OUTPUT);
+    Serial.begin(9600);
+
+    for (uint8_t i = 0; i < 3; i++) {
+        bus.attach(&pumps[i]);
+    }
+
+    // Ten seconds every half minute, and five seconds every twelve.
+    flush.pump = &pumps[0];
+    flush.on = 10000;
+    flush.off = 20000;
+    circulate.pump = &pumps[1];
+    circulate.on = 5000;
+    circulate.off = 7000;
+    dose.pump = &pumps[2];
+    dose.fast = false;
+}
+
+void loop()
+{
+    bus.poll();
+    cycle(&flush);
+    cycle(&circulate);
+    alternate(&dose);
+}
@@ -0,0 +1,309 @@
+/**
+ * @file soak.ino
+ *
+ * Run mixed commands against simulated pumps for as long as the board is
+ * powered, reporting throughput, latency and loss of synchronization.
+ *
+ * The pumps are simulated on a virtual clock, so an hour of bus traffic
+ * takes seconds. Every successful response is checked against the state of
+ * the simulated pump it came from, and every command must finish within its
+ * timeouts. The protocol has no checksum, so a flow rate whose response had
+ * one bit flipped on the line can only be counted, as "flipped". No
+ * command may finish while one of higher priority, submitted before it,
+ * is still waiting.
+ *
+ * extras/soak/soak.cpp runs this sketch on a PC.
+ */
+
+#include <RegloBus.h>
+#include <RegloSimulator.h>
+
+// Number of simulated pumps, at addresses 1 and up.
+const uint8_t PUMPS = 4;
+
+// Simulated milliseconds between reports.
+const unsigned long INTERVAL = 60000;
+
+// Simulated microseconds per pass through loop().
+const unsigned long STEP = 100;
+
+// Latency histogram, one bin per millisecond and the last open ended.
+const uint8_t LATENCY_BINS = 64;
+
+// Simulated milliseconds after which a command counts as lost.
+const unsigned long LOST = 5000;
+
+RegloVirtualClock simulated_clock;
+RegloSimulator line(&simulated_clock);
+RegloBus bus(&line);
+RegloCPF pumps[PUMPS] = {
+    RegloCPF(&line, 1),
+    RegloCPF(&line, 2),
+    RegloCPF(&line, 3),
+    RegloCPF(&line, 4)
+};
+
+// One outstanding command per pump, when it was submitted and in which
+// order.
+RegloCommand commands[PUMPS];
+unsigned long submitted[PUMPS];
+unsigned long sequence[PUMPS];
+unsigned long submissions = 0;
+
+// Counters for the current interval, and over the whole run.
+uint16_t latency[LATENCY_BINS];
+unsigned long completed = 0;
+unsigned long mismatches = 0;
+unsigned long flipped = 0;
+unsigned long overtaken = 0;
+unsigned long failures[REGLO_STATUS_COUNT];
+unsigned long report_started = 0;
+unsigned long total_completed = 0;
+unsigned long total_mismatches = 0;
+unsigned long total_flipped = 0;
+unsigned long total_overtaken = 0;
+unsigned long lost = 0;
+
+/**
+ * Whether two flow rates differ by one bit of their response, which the
+ * line can corrupt unnoticed.
+ */
+bool flip(int mantisse, int exponent, int expected_mantisse,
+        int expected_exponent)
+{
+    // A response of "E-0" reads as exponent 0, so the sign of 0 is taken
+    // to be the expected one.
+    char response[24];
+    char expected[24];
+    snprintf(response, sizeof(response), "%04dE%c%d", mantisse,
+        (exponent < 0 || (exponent == 0 && expected_exponent < 0))
+            ? '-' : '+', abs(exponent));
+    snprintf(expected, sizeof(expected), "%04dE%c%d", expected_mantisse,
+        (expected_exponent < 0) ? '-' : '+', abs(expected_exponent));
+
+    uint8_t bits = 0;
+    for (uint8_t i = 0; response[i] != '\0' && expected[i] != '\0'; i++) {
+        bits += __builtin_popcount((uint8_t) (response[i] ^ expected[i]));
+    }
+    return bits == 1;
+}
+
+/**
+ * Count and print a response that does not match the simulated pump.
+ */
+void mismatch(uint8_t address, uint8_t command)
+{
+    mismatches++;
+    Serial.print("mismatch at ");
+    Serial.print(simulated_clock.millis());
+    Serial.print(" ms: pump ");
+    Serial.print(address);
+    Serial.print(" command ");
+    Serial.println(command);
+}
+
+/**
+ * Record a finished command and check it against the simulated pump.
+ */
+void finished(RegloCommand* command)
+{
+    uint8_t index = (RegloCommand*) command - commands;
+    uint8_t address = index + 1;
+    unsigned long elapsed = (simulated_clock.micros() - submitted[index]) / 1000;
+    latency[(elapsed < LATENCY_BINS) ? elapsed : LATENCY_BINS - 1]++;
+    completed++;
+
+    // Higher priority goes first, whatever its pump is doing.
+    for (uint8_t i = 0; i < PUMPS; i++) {
+        if (!commands[i].done() && commands[i].priority > command->priority
+                && sequence[i] < sequence[index]) {
+            overtaken++;
+            Serial.print("overtaken at ");
+            Serial.print(simulated_clock.millis());
+            Serial.print(" ms: pump ");
+            Serial.print(i + 1);
+            Serial.print(" by pump ");
+            Serial.println(address);
+        }
+    }
+
+    if (command->status != REGLO_OK) {
+        failures[command->status]++;
+        return;
+    }
+
+    // A successful response must describe the pump it was addressed to.
+    int mantisse;
+    int exponent;
+    switch (command->command) {
+    case REGLO_COMMAND_START:
+    case REGLO_COMMAND_STOP:
+        if (line.running(address) != (command->command == REGLO_COMMAND_START)) {
+            mismatch(address, command->command);
+        }
+        break;
+    case REGLO_COMMAND_GET_FLOW_RATE:
+    case REGLO_COMMAND_SET_FLOW_RATE:
+        line.get_flow_rate(address, &mantisse, &exponent);
+        if (mantisse == command->mantisse && exponent == command->exponent) {
+            break;
+        }
+        if (command->command == REGLO_COMMAND_GET_FLOW_RATE
+                && flip(command->mantisse, command->exponent, mantisse,
+                    exponent)) {
+            flipped++;
+            break;
+        }
+        mismatch(address, command->command);
+        break;
+    }
+}
+
+/**
+ * Queue a random command for a pump.
+ */
+void submit(uint8_t index)
+{
+    static const uint8_t MIX[] = {
+        REGLO_COMMAND_START,
+        REGLO_COMMAND_GET_FLOW_RATE,
+        REGLO_COMMAND_SET_FLOW_RATE,
+        REGLO_COMMAND_GET_FLOW_RATE,
+        REGLO_COMMAND_STOP,
+        REGLO_COMMAND_CLOCKWISE
+    };
+
+    RegloCommand* command = &commands[index];
+    command->command = MIX[random(sizeof(MIX))];
+    command->priority = (command->command == REGLO_COMMAND_GET_FLOW_RATE)
+        ? REGLO_PRIORITY_LOW : (command->command == REGLO_COMMAND_STOP)
+        ? REGLO_PRIORITY_HIGH : REGLO_PRIORITY_NORMAL;
+    command->mantisse = random(1000, 10000);
+    command->exponent = random(-4, 0);
+    submitted[index] = simulated_clock.micros();
+    sequence[index] = submissions++;
+    bus.submit(command);
+}
+
+/**
+ * Latency below which a share of the interval's commands finished, in ms.
+ */
+uint8_t percentile(unsigned long share, unsigned long total)
+{
+    unsigned long count = 0;
+    for (uint8_t i = 0; i < LATENCY_BINS; i++) {
+        count += latency[i];
+        if (count * total >= share * completed) {
+            return i;
+        }
+    }
+    return LATENCY_BINS - 1;
+}
+
+/**
+ * Print the counters of the interval and start a new one.
+ */
+void report()
+{
+    const RegloBusStats& stats = bus.stats();
+
+    Serial.print("t=");
+    Serial.print(simulated_clock.millis() / 1000);
+    Serial.print("s commands/s=");
+    Serial.print(completed * 1000 / INTERVAL);
+    Serial.print(" p50=");
+    Serial.print(percentile(50, 100));
+    Serial.print("ms p99=");
+    Serial.print(percentile(99, 100));
+    Serial.print("ms timeouts=");
+    Serial.print(failures[REGLO_TIMEOUT]);
+    Serial.print(" errors=");
+    Serial.print(failures[REGLO_ERROR]);
+    Serial.print(" bad=");
+    Serial.print(failures[REGLO_BAD_RESPONSE]);
+    Serial.print(" out_of_range=");
+    Serial.print(failures[REGLO_OUT_OF_RANGE]);
+    Serial.print(" stray=");
+    Serial.print(stats.stray);
+    Serial.print(" resyncs=");
+    Serial.print(stats.resyncs);
+    Serial.print(" flipped=");
+    Serial.print(flipped);
+    Serial.print(" mismatches=");
+    Serial.print(mismatches);
+    Serial.print(" overtaken=");
+    Serial.print(overtaken);
+#if defined(__AVR__)
+    extern char* __brkval;
+    extern char __heap_start;
+    char top;
+    Serial.print(" free=");
+    Serial.print(&top - (__brkval != NULL ? __brkval : &__heap_start));
+#endif
+    Serial.println();
+
+    total_completed += completed;
+    total_mismatches += mismatches;
+    total_flipped += flipped;
+    total_overtaken += overtaken;
+    memset(latency, 0, sizeof(latency));
+    memset(failures, 0, sizeof(failures));
+    completed = 0;
+    mismatches = 0;
+    flipped = 0;
+    overtaken = 0;
+    bus.reset_stats();
+    report_started = simulated_clock.millis();
+}
+
+/**
+ * Set up the simulated line with a light load of faults.
+ */
+void setup()
+{
+    Serial.begin(9600);
+    randomSeed(1);
+
+    RegloFaults faults = { 200, 200, 500, 500, 200, 50000 };
+    line.set_faults(faults);
+
+    // Pumps that need a pause after each response, so commands queue up
+    // behind pausing pumps.
+    line.set_recovery(15000);
+
+    bus.set_clock(&simulated_clock);
+    for (uint8_t i = 0; i < PUMPS; i++) {
+        line.add_pump(i + 1);
+        bus.attach(&pumps[i]);
+        commands[i].pump = &pumps[i];
+        commands[i].callback = finished;
+    }
+}
+
+/**
+ * Keep every pump busy and report at the end of each interval.
+ */
+void loop()
+{
+    for (uint8_t i = 0; i < PUMPS; i++) {
+        if (commands[i].done()) {
+            submit(i);
+        } else if ((simulated_clock.micros() - submitted[i]) / 1000 > LOST) {
+            lost++;
+            submitted[i] = simulated_clock.micros();
+            Serial.print("lost at ");
+            Serial.print(simulated_clock.millis());
+            Serial.print(" ms: pump ");
+            Serial.print(i + 1);
+            Serial.print(" command ");
+            Serial.println(commands[i].command);
+        }
+    }
+
+    bus.poll();
+    simulated_clock.advance(STEP);
+
+    if (simulated_clock.millis() - report_started >= INTERVAL) {
+        report();
+    }
+}
@@ -0,0 +1,161 @@
+/**
+ * @file workflows.cpp
+ *
+ * A thousand pump workflows written as coroutines, see RegloCoroutine.h,
+ * sharing simulated pumps on several lines from one thread.
+ *
+ * Each workflow sets a random flow rate, starts its pump, reads the rate
+ * back and stops the pump, a few rounds over. The rates the pumps echo
+ * are checked against the simulated pumps, including the rates a pump
+ * clamps to its limits. Halfway through one line is aborted for good, and
+ * its workflows must end rather than wait forever. The program exits with
+ * 1 on a mismatch or a workflow that never ends:
+ *
+ *     g++ -std=gnu++20 -O2 -Iextras/host -I. extras/coroutine/workflows.cpp \
+ *         extras/host/Arduino.cpp Reglo*.cpp -o workflows
+ *     ./workflows [workflows [seed]]
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+
+#include "RegloCoroutine.h"
+#include "RegloSimulator.h"
+
+// Lines, and pumps on each at addresses 1 and up.
+const uint8_t LINES = 4;
+const uint8_t PUMPS = 4;
+
+// Rounds of commands per workflow.
+const uint8_t ROUNDS = 3;
+
+// Simulated microseconds per pass through the loop.
+const unsigned long STEP = 100;
+
+// Simulated milliseconds after which the line to abort is aborted, and
+// after which a workflow still running counts as stuck.
+const unsigned long ABORT_AT = 2000;
+const unsigned long GIVE_UP = 600000;
+
+static RegloVirtualClock simulated_clock;
+static RegloSimulator* lines[LINES];
+static RegloBus* buses[LINES];
+static RegloCPF* pumps[LINES][PUMPS];
+
+// Outcome of the workflows.
+static unsigned long running;
+static unsigned long completed;
+static unsigned long aborted;
+static unsigned long failures;
+static unsigned long clamped;
+static unsigned long mismatches;
+
+/**
+ * Whether the echo of a rate matches the simulated pump.
+ */
+static bool matches(uint8_t line, uint8_t address, int mantisse,
+		int exponent) {
+	int expected_mantisse;
+	int expected_exponent;
+	lines[line]->get_flow_rate(address, &expected_mantisse,
+			&expected_exponent);
+	if (mantisse == expected_mantisse && exponent == expected_exponent) {
+		return true;
+	}
+	mismatches++;
+	printf("mismatch at %lu ms: line %u pump %u\n", simulated_clock.millis(),
+			line, address);
+	return false;
+}
+
+/**
+ * One workflow on a pump of a line.
+ */
+static RegloTask workflow(uint8_t line, uint8_t address) {
+	RegloCPF* pump = pumps[line][address - 1];
+	running++;
+	int status = REGLO_OK;
+	for (uint8_t round = 0; round < ROUNDS; round++) {
+		int mantisse = random(1000, 10000);
+		int exponent = random(-3, 0);
+		status = co_await reglo_set_flow_rate(pump, &mantisse, &exponent);
+		if (status == REGLO_OK || status == REGLO_BAD_RESPONSE) {
+			// A clamped rate comes back as the rate the pump runs at.
+			if (matches(line, address, mantisse, exponent)
+					&& status == REGLO_BAD_RESPONSE) {
+				clamped++;
+			}
+		} else if (status == REGLO_ABORTED) {
+			break;
+		}
+
+		status = co_await reglo_start(pump);
+		if (status == REGLO_ABORTED) {
+			break;
+		}
+
+		status = co_await reglo_get_flow_rate(pump, &mantisse, &exponent);
+		if (status == REGLO_OK) {
+			matches(line, address, mantisse, exponent);
+		} else if (status == REGLO_ABORTED) {
+			break;
+		}
+
+		status = co_await reglo_stop(pump);
+		if (status == REGLO_ABORTED) {
+			break;
+		}
+	}
+
+	running--;
+	if (status == REGLO_ABORTED) {
+		aborted++;
+	} else {
+		completed++;
+		if (status != REGLO_OK) {
+			failures++;
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	unsigned long count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000;
+	unsigned long seed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+	randomSeed(seed);
+
+	for (uint8_t line = 0; line < LINES; line++) {
+		lines[line] = new RegloSimulator(&simulated_clock, 9600, seed + line);
+		buses[line] = new RegloBus(lines[line]);
+		buses[line]->set_clock(&simulated_clock);
+		for (uint8_t i = 0; i < PUMPS; i++) {
+			lines[line]->add_pump(i + 1);
+			pumps[line][i] = new RegloCPF(lines[line], i + 1);
+			buses[line]->attach(pumps[line][i]);
+		}
+		// Clamp one pump per line to 0.5 to 5 ml/min.
+		lines[line]->set_flow_rate_limits(1, 5000, -4, 5000, -3);
+	}
+
+	for (unsigned long i = 0; i < count; i++) {
+		uint8_t line = i % LINES;
+		workflow(line, (i / LINES) % PUMPS + 1);
+	}
+
+	bool aborting = true;
+	while (running > 0 && simulated_clock.millis() < GIVE_UP) {
+		if (aborting && simulated_clock.millis() >= ABORT_AT) {
+			buses[0]->abort();
+			aborting = false;
+		}
+		for (uint8_t line = 0; line < LINES; line++) {
+			buses[line]->poll();
+		}
+		simulated_clock.advance(STEP);
+	}
+
+	printf("%lu workflows in %lu ms: %lu completed, %lu aborted, "
+			"%lu failed, %lu clamped, %lu mismatches, %lu stuck\n",
+			count, simulated_clock.millis(), completed, aborted, failures,
+			clamped, mismatches, running);
+	return (mismatches == 0 && running == 0 && completed > 0) ? 0 : 1;
+}
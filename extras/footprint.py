@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""Report the flash, SRAM and stack the Reglo-CPF library takes.
+
+Compiles the library in several feature configurations with -fstack-usage,
+then prints for each:
+
+- the section sizes of the objects, from size or avr-size,
+- the largest stack frames, from the .su files the compiler writes,
+- the deepest call chains, adding up frames along the direct calls found
+  in the disassembly.
+
+Calls through a pointer (virtual Stream methods, callbacks) and calls into
+the C library cannot be followed and are listed instead; their frames come
+on top of the figures printed.
+
+The AVR build is the one the budgets in RegloConfig.h are for. It needs
+avr-g++ and an Arduino AVR core, found under ~/.arduino15 or given with
+--avr-core. The script fails if a frame exceeds REGLO_STACK_BUDGET or a
+chain exceeds REGLO_CALL_STACK_BUDGET, and the build itself fails if a
+type exceeds its size budget. The host build, with the shim in
+extras/host, shows the same figures for a 64 bit machine and is not checked
+against the budgets.
+
+Usage: extras/footprint.py [--avr-core DIR] [--mcu MCU] [--host] [--avr]
+"""
+
+import argparse
+import glob
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HOST = os.path.join(ROOT, 'extras', 'host')
+
+CONFIGURATIONS = [
+    ('default', []),
+    ('no flow rate', ['-DREGLO_ENABLE_FLOW_RATE=0']),
+    ('no control panel', ['-DREGLO_ENABLE_CONTROL_PANEL=0']),
+    ('no stats', ['-DREGLO_ENABLE_STATS=0']),
+    ('minimal', ['-DREGLO_ENABLE_FLOW_RATE=0',
+                 '-DREGLO_ENABLE_CONTROL_PANEL=0',
+                 '-DREGLO_ENABLE_STATS=0']),
+]
+
+COMMON_FLAGS = ['-std=gnu++11', '-Os', '-fno-exceptions',
+                '-fno-threadsafe-statics', '-ffunction-sections',
+                '-fdata-sections', '-fstack-usage', '-c']
+
+# Call instructions and the relocations naming their targets.
+CALL = re.compile(r'\s(call|rcall|jmp|rjmp)\s')
+INDIRECT = re.compile(r'\s(icall|eicall|ijmp|eijmp)\b|\scall\s+\*')
+RELOCATION = re.compile(
+    r'R_(?:AVR_CALL|AVR_13_PCREL|X86_64_PLT32|X86_64_PC32)\s+(\S+?)(?:[-+]0x[0-9a-f]+)?$')
+SYMBOL = re.compile(r'^[0-9a-f]+ <(.+)>:$')
+
+
+def budget(name):
+    """Default of a setting in RegloConfig.h."""
+    with open(os.path.join(ROOT, 'RegloConfig.h')) as config:
+        match = re.search(r'#define %s (\d+)' % name, config.read())
+    return int(match.group(1))
+
+
+def find_avr_core():
+    """Include directories of an installed Arduino AVR core."""
+    pattern = os.path.expanduser(
+        '~/.arduino15/packages/arduino/hardware/avr/*/cores/arduino')
+    cores = sorted(glob.glob(pattern))
+    return cores[-1] if cores else None
+
+
+def qualified(name):
+    """Name of a function without return type and parameters, the one key
+    .su files and demangled symbols agree on."""
+    name = name.split('(')[0].strip()
+    return name.split(' ')[-1]
+
+
+def demangle(symbols, filt):
+    if not symbols:
+        return {}
+    output = subprocess.run([filt], input='\n'.join(symbols), text=True,
+                            capture_output=True, check=True).stdout
+    return dict(zip(symbols, output.split('\n')))
+
+
+def compile_library(compiler, flags, directory):
+    objects = []
+    for source in sorted(glob.glob(os.path.join(ROOT, 'Reglo*.cpp'))):
+        stem = os.path.splitext(os.path.basename(source))[0]
+        output = os.path.join(directory, stem + '.o')
+        subprocess.run([compiler] + flags + [source, '-o', output],
+                       check=True)
+        objects.append(output)
+    return objects
+
+
+def frames(objects):
+    """Stack frame of each function, by qualified name, the largest of any
+    overloads."""
+    result = {}
+    dynamic = set()
+    for su in (os.path.splitext(o)[0] + '.su' for o in objects):
+        with open(su) as lines:
+            for line in lines:
+                location, size, kind = line.rstrip('\n').split('\t')
+                name = qualified(location.split(':', 3)[3])
+                result[name] = max(result.get(name, 0), int(size))
+                if kind.startswith('dynamic') and kind != 'dynamic,bounded':
+                    dynamic.add(name)
+    return result, dynamic
+
+
+def calls(objects, objdump, filt):
+    """Direct callees of each function, and the functions that also call
+    through a pointer."""
+    graph = {}
+    indirect = set()
+    mangled = set()
+    edges = []
+    for obj in objects:
+        listing = subprocess.run([objdump, '-dr', obj], text=True,
+                                 capture_output=True, check=True).stdout
+        caller = None
+        calling = False
+        for line in listing.split('\n'):
+            symbol = SYMBOL.match(line)
+            if symbol:
+                caller = symbol.group(1)
+                mangled.add(caller)
+                calling = False
+                continue
+            if caller is None:
+                continue
+            if INDIRECT.search(line):
+                indirect.add(caller)
+            if CALL.search(line):
+                calling = True
+                continue
+            relocation = RELOCATION.search(line)
+            if relocation and calling:
+                callee = relocation.group(1)
+                if callee.startswith('.text.'):
+                    callee = callee[len('.text.'):]
+                mangled.add(callee)
+                edges.append((caller, callee))
+            calling = False
+    names = demangle(sorted(mangled), filt)
+    for caller, callee in edges:
+        graph.setdefault(qualified(names[caller]), set()).add(
+            qualified(names[callee]))
+    return graph, set(qualified(names[name]) for name in indirect)
+
+
+def chains(frame, graph):
+    """Deepest stack of each function with its direct callees, and the path
+    taken."""
+    memo = {}
+
+    def deepest(name, visiting):
+        if name in memo:
+            return memo[name]
+        if name in visiting:
+            return 0, [name + ' (recursion)']
+        visiting.add(name)
+        best = (0, [])
+        for callee in graph.get(name, ()):
+            if callee == name:
+                continue
+            depth = deepest(callee, visiting)
+            if depth[0] > best[0]:
+                best = depth
+        visiting.discard(name)
+        memo[name] = (frame.get(name, 0) + best[0], [name] + best[1])
+        return memo[name]
+
+    return {name: deepest(name, set()) for name in frame}
+
+
+def report(title, compiler, flags, tools, checked, args):
+    size, objdump, filt = tools
+    failed = False
+    for label, defines in CONFIGURATIONS:
+        with tempfile.TemporaryDirectory() as directory:
+            try:
+                objects = compile_library(compiler, flags + defines,
+                                          directory)
+            except subprocess.CalledProcessError:
+                print('%s, %s: build failed' % (title, label))
+                failed = True
+                continue
+
+            print('== %s, %s' % (title, label))
+            print(subprocess.run([size, '-t'] + objects, text=True,
+                                 capture_output=True,
+                                 check=True).stdout.replace(directory + '/',
+                                                            ''))
+
+            frame, dynamic = frames(objects)
+            graph, indirect = calls(objects, objdump, filt)
+            deepest = chains(frame, graph)
+            known = set(frame)
+            external = sorted(set(c for callees in graph.values()
+                                  for c in callees if c not in known))
+
+            print('Largest frames (bytes):')
+            for name in sorted(frame, key=frame.get, reverse=True)[:args.top]:
+                note = ' (dynamic)' if name in dynamic else ''
+                print('  %5d  %s%s' % (frame[name], name, note))
+
+            print('Deepest call chains (bytes):')
+            ranked = sorted(deepest, key=lambda n: deepest[n][0],
+                            reverse=True)
+            for name in ranked[:args.top]:
+                depth, path = deepest[name]
+                note = ' +indirect' if any(p in indirect for p in path) \
+                    else ''
+                print('  %5d  %s%s' % (depth, ' > '.join(path), note))
+            if external:
+                print('Not followed: ' + ', '.join(external))
+            print()
+
+            if not checked:
+                continue
+            for name in sorted(frame):
+                if frame[name] > args.stack_budget:
+                    print('FAIL: %s frame of %d B exceeds REGLO_STACK_BUDGET'
+                          ' (%d)' % (name, frame[name], args.stack_budget))
+                    failed = True
+                if deepest[name][0] > args.call_stack_budget:
+                    print('FAIL: %s chain of %d B exceeds '
+                          'REGLO_CALL_STACK_BUDGET (%d)'
+                          % (name, deepest[name][0], args.call_stack_budget))
+                    failed = True
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split('\n')[0])
+    parser.add_argument('--avr-core',
+                        help='directory of the Arduino AVR core, with '
+                             'Arduino.h')
+    parser.add_argument('--avr-variant',
+                        help='directory of the board variant, with '
+                             'pins_arduino.h, default: variants/standard')
+    parser.add_argument('--mcu', default='atmega328p')
+    parser.add_argument('--host', action='store_true',
+                        help='only build for this machine')
+    parser.add_argument('--avr', action='store_true',
+                        help='only build for AVR')
+    parser.add_argument('--top', type=int, default=8,
+                        help='functions listed per table')
+    parser.add_argument('--stack-budget', type=int,
+                        default=budget('REGLO_STACK_BUDGET'))
+    parser.add_argument('--call-stack-budget', type=int,
+                        default=budget('REGLO_CALL_STACK_BUDGET'))
+    args = parser.parse_args()
+
+    failed = False
+    if not args.avr:
+        failed |= report('host', 'g++', COMMON_FLAGS + ['-I' + HOST,
+                                                        '-I' + ROOT],
+                         ('size', 'objdump', 'c++filt'), False, args)
+
+    if not args.host:
+        core = args.avr_core or find_avr_core()
+        if shutil.which('avr-g++') is None or core is None:
+            print('AVR: avr-g++ or the Arduino AVR core not found, see '
+                  '--avr-core')
+            return 1
+        variant = args.avr_variant or os.path.join(
+            os.path.dirname(os.path.dirname(core)), 'variants', 'standard')
+        flags = COMMON_FLAGS + ['-mmcu=' + args.mcu, '-DF_CPU=16000000L',
+                                '-DARDUINO=10819', '-DARDUINO_ARCH_AVR',
+                                '-I' + core, '-I' + variant, '-I' + ROOT]
+        failed |= report('AVR ' + args.mcu, 'avr-g++', flags,
+                         ('avr-size', 'avr-objdump', 'avr-c++filt'), True,
+                         args)
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,197 @@
+/**
+ * @file fuzz_response.cpp
+ *
+ * Fuzz target for the parsing of pump responses.
+ *
+ * The input is taken as the bytes a pump sends, and fed through each path
+ * that reads responses: RegloCPF::parse_float() directly, the blocking
+ * commands, which read it with confirm() and read_float_from_pump(), and
+ * the queued commands, which read it with RegloBus::receive(). Time is
+ * simulated, so running out of input ends in a timeout at once.
+ *
+ * With libFuzzer, from the library directory:
+ *
+ *     clang++ -g -O1 -fsanitize=fuzzer,address,undefined -Iextras/host -I. \
+ *         extras/fuzz/fuzz_response.cpp extras/host/Arduino.cpp Reglo*.cpp \
+ *         -o fuzz_response
+ *     ./fuzz_response
+ *
+ * Without it, add -DREGLO_FUZZ_MAIN for a driver that runs the files named
+ * on the command line, or else random inputs.
+ */
+
+#include <Arduino.h>
+
+#include "RegloBus.h"
+
+/**
+ * Stream that hands out the fuzz input as responses.
+ *
+ * Each request lets the next bytes arrive from a little after the request
+ * has left the line, one byte time apart, so the bus takes them for a
+ * response rather than for stray bytes.
+ */
+class FuzzStream : public Stream {
+
+	const uint8_t* _data;
+	size_t _size;
+	size_t _position;
+	RegloClock* _clock;
+	unsigned long _next;
+
+public:
+
+	FuzzStream(const uint8_t* data, size_t size, RegloClock* clock) {
+		_data = data;
+		_size = size;
+		_position = 0;
+		_clock = clock;
+		_next = 0;
+	}
+
+	virtual int available() {
+		return (_position < _size
+				&& (long) (_clock->micros() - _next) >= 0) ? 1 : 0;
+	}
+
+	virtual int read() {
+		if (!available()) {
+			return -1;
+		}
+		_next += 1042;
+		return _data[_position++];
+	}
+
+	virtual int peek() {
+		return available() ? _data[_position] : -1;
+	}
+
+	virtual size_t write(uint8_t c) {
+		if (c == '\r') {
+			_next = _clock->micros() + 20 * 1042UL;
+		}
+		return 1;
+	}
+
+	using Print::write;
+
+	bool exhausted() {
+		return _position >= _size;
+	}
+
+};
+
+/**
+ * Run blocking commands until the input is used up.
+ */
+static void blocking(const uint8_t* data, size_t size) {
+	RegloVirtualClock clock;
+	FuzzStream stream(data, size, &clock);
+	RegloCPF pump(&stream, 1);
+	pump.set_clock(&clock);
+
+	for (uint8_t round = 0; !stream.exhausted() && round < 64; round++) {
+		int mantisse = 1234;
+		int exponent = -2;
+		switch (round % 3) {
+		case 0:
+			pump.start();
+			break;
+		case 1:
+			pump.get_flow_rate(&mantisse, &exponent);
+			break;
+		default:
+			pump.set_flow_rate(&mantisse, &exponent);
+			break;
+		}
+	}
+}
+
+/**
+ * Run queued commands until the input is used up.
+ */
+static void queued(const uint8_t* data, size_t size) {
+	RegloVirtualClock clock;
+	FuzzStream stream(data, size, &clock);
+	RegloBus bus(&stream);
+	bus.set_clock(&clock);
+	RegloCPF pump(&stream, 1);
+	bus.attach(&pump);
+
+	const uint8_t commands[] = { REGLO_COMMAND_START,
+			REGLO_COMMAND_GET_FLOW_RATE, REGLO_COMMAND_SET_FLOW_RATE };
+	for (uint8_t round = 0; !stream.exhausted() && round < 64; round++) {
+		RegloCommand command(&pump, commands[round % 3]);
+		command.mantisse = 1234;
+		command.exponent = -2;
+		if (bus.submit(&command) != REGLO_OK) {
+			return;
+		}
+		for (unsigned long step = 0; !command.done() && step < 100000;
+				step++) {
+			bus.poll();
+			clock.advance(100);
+		}
+		if (!command.done()) {
+			__builtin_trap();  // The bus never gave up on the command.
+		}
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	int mantisse = 0;
+	int exponent = 0;
+	if (RegloCPF::parse_float((const char*) data,
+			(size < 255) ? size : 255, &mantisse, &exponent) == REGLO_OK
+			&& (size != RegloCPF::FLOAT_RESPONSE_LENGTH || mantisse < 0
+					|| mantisse > 9999 || exponent < -9 || exponent > 9)) {
+		__builtin_trap();
+	}
+
+	blocking(data, size);
+	queued(data, size);
+	return 0;
+}
+
+#ifdef REGLO_FUZZ_MAIN
+#include <stdio.h>
+
+int main(int argc, char** argv) {
+	static uint8_t data[4096];
+
+	for (int i = 1; i < argc; i++) {
+		FILE* file = fopen(argv[i], "rb");
+		if (file == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		size_t size = fread(data, 1, sizeof(data), file);
+		fclose(file);
+		LLVMFuzzerTestOneInput(data, size);
+	}
+
+	if (argc == 1) {
+		// Random responses, some well formed, with random bytes between.
+		for (long run = 0; run < 20000; run++) {
+			size_t size = 0;
+			while (size < 64) {
+				long kind = random(8);
+				if (kind == 0) {
+					break;
+				} else if (kind < 3) {
+					data[size++] = random(2) ? '*' : '#';
+				} else if (kind < 7) {
+					size += snprintf((char*) data + size, 10, "%04ldE%c%ld\r\n",
+							(kind == 3) ? 1234 : random(10000),
+							random(2) ? '-' : '+', random(10));
+				} else {
+					data[size++] = random(256);
+				}
+			}
+			LLVMFuzzerTestOneInput(data, size);
+		}
+		printf("20000 random inputs\n");
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,129 @@
+/**
+ * @file Arduino.cpp
+ *
+ * The part of the Arduino core the library and its examples use, so they
+ * build on a PC.
+ */
+
+#include <chrono>
+#include <thread>
+
+#include "Arduino.h"
+
+HardwareSerial Serial;
+
+static std::chrono::steady_clock::time_point started =
+		std::chrono::steady_clock::now();
+
+// Like on the boards, the clocks count from the start of the program and
+// wrap around at the width of unsigned long.
+unsigned long millis() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - started).count();
+}
+
+unsigned long micros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - started).count();
+}
+
+void delay(unsigned long milliseconds) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+void delayMicroseconds(unsigned int microseconds) {
+	std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+void yield() {
+	std::this_thread::yield();
+}
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+void digitalWrite(uint8_t, uint8_t) {
+}
+
+static unsigned long state = 1;
+
+long random(long limit) {
+	if (limit <= 0) {
+		return 0;
+	}
+
+	// Xorshift, the same sequence on every host for a given seed.
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (long) ((state & 0x7FFFFFFFUL) % (unsigned long) limit);
+}
+
+long random(long low, long limit) {
+	return (limit > low) ? low + random(limit - low) : low;
+}
+
+void randomSeed(unsigned long seed) {
+	state = (seed != 0) ? seed : 1;
+}
+
+void HardwareSerial::begin(unsigned long) {
+}
+
+int HardwareSerial::available() {
+	return 0;
+}
+
+int HardwareSerial::read() {
+	return -1;
+}
+
+int HardwareSerial::peek() {
+	return -1;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+	return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+void HardwareSerial::flush() {
+	fflush(stdout);
+}
+
+size_t Print::print(const char* text) {
+	return write(text);
+}
+
+size_t Print::print(char c) {
+	return write((uint8_t) c);
+}
+
+size_t Print::print(int value) {
+	return print((long) value);
+}
+
+size_t Print::print(unsigned int value) {
+	return print((unsigned long) value);
+}
+
+size_t Print::print(long value) {
+	char text[24];
+	snprintf(text, sizeof(text), "%ld", value);
+	return write(text);
+}
+
+size_t Print::print(unsigned long value) {
+	char text[24];
+	snprintf(text, sizeof(text), "%lu", value);
+	return write(text);
+}
+
+size_t Print::print(double value, int digits) {
+	char text[48];
+	snprintf(text, sizeof(text), "%.*f", digits, value);
+	return write(text);
+}
+
+size_t Print::println() {
+	return write("\r\n");
+}
@@ -0,0 +1,59 @@
+/**
+ * @file Arduino.h
+ *
+ * The part of the Arduino core the library and its examples use, so they
+ * build on a PC. Time is the process's monotonic clock, pins do nothing
+ * and Serial writes to standard output.
+ */
+
+#ifndef REGLO_HOST_ARDUINO_H
+#define REGLO_HOST_ARDUINO_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Stream.h"
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long milliseconds);
+void delayMicroseconds(unsigned int microseconds);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+long random(long limit);
+long random(long low, long limit);
+void randomSeed(unsigned long seed);
+
+/**
+ * Serial port 0, standard output.
+ */
+class HardwareSerial : public Stream {
+
+public:
+
+	void begin(unsigned long baud);
+
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual size_t write(uint8_t c);
+	virtual void flush();
+
+	using Print::write;
+
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * @file Print.h
+ *
+ * The part of the Arduino Print class the library and its tools use, for
+ * host builds.
+ */
+
+#ifndef REGLO_HOST_PRINT_H
+#define REGLO_HOST_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class Print {
+
+public:
+
+	virtual ~Print() {
+	}
+
+	virtual size_t write(uint8_t c) = 0;
+
+	virtual size_t write(const uint8_t* buffer, size_t size) {
+		size_t written = 0;
+		while (size-- > 0) {
+			written += write(*buffer++);
+		}
+		return written;
+	}
+
+	size_t write(const char* text) {
+		return write((const uint8_t*) text, strlen(text));
+	}
+
+	virtual void flush() {
+	}
+
+	size_t print(const char* text);
+	size_t print(char c);
+	size_t print(int value);
+	size_t print(unsigned int value);
+	size_t print(long value);
+	size_t print(unsigned long value);
+	size_t print(double value, int digits = 2);
+
+	size_t println();
+
+	template<typename T>
+	size_t println(T value) {
+		size_t written = print(value);
+		return written + println();
+	}
+
+};
+
+#endif
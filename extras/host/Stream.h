@@ -0,0 +1,22 @@
+/**
+ * @file Stream.h
+ *
+ * The part of the Arduino Stream class the library uses, for host builds.
+ */
+
+#ifndef REGLO_HOST_STREAM_H
+#define REGLO_HOST_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print {
+
+public:
+
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+
+};
+
+#endif
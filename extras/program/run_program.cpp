@@ -0,0 +1,149 @@
+/**
+ * @file run_program.cpp
+ *
+ * Runs pump programs, see RegloProgram, on simulated pumps on a PC, so a
+ * program can be tried before it is loaded onto a controller.
+ *
+ * Each file named holds the program text for one pump, at addresses 1 and
+ * up, and the programs run side by side on one line. Every change of pump
+ * state is printed with its simulated time:
+ *
+ *     g++ -std=gnu++11 -O2 -Iextras/host -I. extras/program/run_program.cpp \
+ *         extras/host/Arduino.cpp Reglo*.cpp -o run_program
+ *     ./run_program [-t milliseconds] program...
+ *
+ * Programs that loop for ever are stopped after the time given, a simulated
+ * hour by default. The program exits with 1 if a program does not
+ * assemble or load, or ends with another status than REGLO_OK.
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "RegloProgram.h"
+#include "RegloSimulator.h"
+
+// Simulated microseconds per pass through the loop.
+const unsigned long STEP = 100;
+
+// Largest program text and bytecode per pump.
+const size_t SOURCE_SIZE = 4096;
+const uint16_t CODE_SIZE = 512;
+
+static RegloVirtualClock simulated_clock;
+static RegloSimulator line(&simulated_clock);
+static RegloBus bus(&line);
+
+/**
+ * Read a whole file into a buffer, NUL terminated.
+ */
+static bool slurp(const char* path, char* text, size_t size) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return false;
+	}
+	size_t length = fread(text, 1, size - 1, file);
+	bool whole = feof(file);
+	fclose(file);
+	if (!whole) {
+		fprintf(stderr, "%s: longer than %u bytes\n", path,
+				(unsigned) size - 1);
+		return false;
+	}
+	text[length] = '\0';
+	return true;
+}
+
+int main(int argc, char** argv) {
+	static char source[SOURCE_SIZE];
+	static uint8_t code[REGLO_MAX_PUMPS][CODE_SIZE];
+	RegloCPF* pumps[REGLO_MAX_PUMPS];
+	RegloProgram* programs[REGLO_MAX_PUMPS];
+
+	unsigned long duration = 3600000;
+	int first = 1;
+	if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+		duration = strtoul(argv[2], NULL, 10);
+		first = 3;
+	}
+	uint8_t count = argc - first;
+	if (count == 0 || count > REGLO_MAX_PUMPS) {
+		fprintf(stderr, "usage: %s [-t milliseconds] program...\n"
+				"with 1 to %u programs\n", argv[0], REGLO_MAX_PUMPS);
+		return 2;
+	}
+
+	bus.set_clock(&simulated_clock);
+	for (uint8_t i = 0; i < count; i++) {
+		const char* path = argv[first + i];
+		uint16_t length;
+		if (!slurp(path, source, sizeof(source))) {
+			return 1;
+		}
+		int status = RegloProgram::assemble(source, code[i], CODE_SIZE,
+				&length);
+		if (status != REGLO_OK) {
+			fprintf(stderr, "%s:%u: %s\n", path, length,
+					(status == REGLO_OUT_OF_RANGE) ? "program too long"
+							: "bad instruction");
+			return 1;
+		}
+
+		line.add_pump(i + 1);
+		pumps[i] = new RegloCPF(&line, i + 1);
+		bus.attach(pumps[i]);
+		programs[i] = new RegloProgram(&bus, pumps[i]);
+		if (programs[i]->load(code[i], length) != REGLO_OK) {
+			fprintf(stderr, "%s: does not load\n", path);
+			return 1;
+		}
+		printf("pump %u: %s, %u bytes\n", i + 1, path, length);
+	}
+
+	// Simulated pumps start stopped and clockwise.
+	bool running[REGLO_MAX_PUMPS] = { false };
+	bool clockwise[REGLO_MAX_PUMPS];
+	memset(clockwise, true, sizeof(clockwise));
+
+	int failed = 0;
+	uint8_t active = count;
+	while (active > 0 && simulated_clock.millis() < duration) {
+		simulated_clock.advance(STEP);
+		bus.poll();
+
+		active = 0;
+		for (uint8_t i = 0; i < count; i++) {
+			if (programs[i]->run()) {
+				active++;
+			}
+
+			bool now_running = line.running(i + 1);
+			bool now_clockwise = line.clockwise(i + 1);
+			if (now_running != running[i] || now_clockwise != clockwise[i]) {
+				running[i] = now_running;
+				clockwise[i] = now_clockwise;
+				printf("%lu ms: pump %u %s %s\n", simulated_clock.millis(),
+						i + 1, now_running ? "running" : "stopped",
+						now_clockwise ? "clockwise" : "counter-clockwise");
+			}
+		}
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		int status = programs[i]->status();
+		if (programs[i]->run()) {
+			printf("pump %u: still running at %u\n", i + 1,
+					programs[i]->position());
+			programs[i]->cancel();
+		} else if (status != REGLO_OK) {
+			printf("pump %u: failed with %d at %u\n", i + 1, status,
+					programs[i]->position());
+			failed = 1;
+		} else {
+			printf("pump %u: done\n", i + 1);
+		}
+	}
+	return failed;
+}
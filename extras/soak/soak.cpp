@@ -0,0 +1,40 @@
+/**
+ * @file soak.cpp
+ *
+ * Runs the soak test sketch, examples/soak/soak.ino, on a PC: mixed
+ * commands against simulated pumps on a faulty line, reporting throughput,
+ * latency and loss of synchronization each simulated minute.
+ *
+ * The program exits with 1 on a response that does not match its
+ * simulated pump, other than a flow rate with one bit flipped, on a command
+ * overtaken by one of lower priority, or on a lost command, so it can run
+ * in CI:
+ *
+ *     g++ -std=gnu++11 -O2 -Iextras/host -I. extras/soak/soak.cpp \
+ *         extras/host/Arduino.cpp Reglo*.cpp -o soak
+ *     ./soak [minutes [seed]]
+ *
+ * An hour of simulated traffic takes a few seconds.
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+
+#include "../../examples/soak/soak.ino"
+
+int main(int argc, char** argv) {
+	unsigned long minutes = (argc > 1) ? strtoul(argv[1], NULL, 10) : 60;
+	unsigned long seed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+	setup();
+	randomSeed(seed);
+	while (simulated_clock.millis() < minutes * INTERVAL) {
+		loop();
+	}
+
+	printf("%lu commands, %lu flipped, %lu mismatches, %lu overtaken, "
+			"%lu lost\n", total_completed, total_flipped, total_mismatches,
+			total_overtaken, lost);
+	return (total_mismatches == 0 && total_overtaken == 0 && lost == 0
+			&& total_completed > 0) ? 0 : 1;
+}